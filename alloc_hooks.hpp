@@ -0,0 +1,40 @@
+#pragma once
+
+// Replacement operator new and delete counting the allocations of every thread into
+// thread_allocations and thread_allocated_bytes (see bytecode.hpp). They replace the global ones,
+// so a program includes this header from exactly one translation unit, and only if it wants the counts
+
+#include <cstdlib>
+#include <new>
+
+#include "bytecode.hpp"
+
+// Aligned allocations are left alone
+void *operator new(size_t n) {
+  thread_allocations++;
+  thread_allocated_bytes += n;
+  if (void *p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t n) { return operator new(n); }
+void *operator new(size_t n, const std::nothrow_t &) noexcept {
+  try {
+    return operator new(n);
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+void *operator new[](size_t n, const std::nothrow_t &tag) noexcept { return operator new(n, tag); }
+
+// Everything else goes through the unsized delete, the only one that frees.
+// GCC pairs the free with operator new once both are inlined, not knowing that new is malloc here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { operator delete(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { operator delete(p); }
@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+
+#include "alloc_hooks.hpp"
+#include "bytecode.hpp"
+
+// #####################################################################
+// ##                            Benchmark                            ##
+// #####################################################################
+// Times every phase of the tool separately on each input file:
+//   load    - BytecodeFile::load_file (mmap), pages are faulted in by the next phase
+//   istream - BytecodeFile::load from an std::ifstream
+//   decode  - DecodedProgram::decode
+//   parse   - Frequencies::parse over the decoded index
+//   bytes   - Frequencies::parse straight from the bytes, as the parallel mode does
+//   print   - Frequencies::print into a discarding stream
+// Each phase is repeated and the best time is reported, along with allocations of one run.
+
+struct NullBuffer : std::streambuf {
+  int             overflow(int c) override { return c; }
+  std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+};
+
+struct Measurement {
+  double seconds     = 0;
+  size_t allocations = 0;
+  size_t bytes       = 0;
+};
+
+template <typename F> Measurement measure(int repeats, F &&f) {
+  Measurement res;
+  res.seconds = INFINITY;
+  for (int i = 0; i < repeats; ++i) {
+    size_t allocs_before = thread_allocations, bytes_before = thread_allocated_bytes;
+    auto   start         = std::chrono::steady_clock::now();
+    f();
+    auto end        = std::chrono::steady_clock::now();
+    res.seconds     = std::min(res.seconds, std::chrono::duration<double>(end - start).count());
+    res.allocations = thread_allocations - allocs_before;
+    res.bytes       = thread_allocated_bytes - bytes_before;
+  }
+  return res;
+}
+
+void report(const char *phase, const Measurement &m, size_t n_bytes, size_t n_instrs) {
+  std::printf("  %-8s %10.3f ms %10.1f MB/s %10.2f Minstr/s %10zu allocs %12zu bytes\n",
+              phase,
+              m.seconds * 1e3,
+              n_bytes / m.seconds / 1e6,
+              n_instrs / m.seconds / 1e6,
+              m.allocations,
+              m.bytes);
+}
+
+int main(int argc, const char *argv[]) {
+  int repeats = 5;
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " [-r REPEATS] <bytecode file>...\n";
+    return EXIT_FAILURE;
+  }
+
+  NullBuffer   null_buffer;
+  std::ostream null_stream(&null_buffer);
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::string_view(argv[i]) == "-r" && i + 1 < argc) {
+      repeats = std::max(1, std::atoi(argv[++i]));
+      continue;
+    }
+    const char *path = argv[i];
+
+    BytecodeFile   src;
+    DecodedProgram prog;
+    Frequencies    freq;
+
+    Measurement load    = measure(repeats, [&] { src.load_file(path); });
+    Measurement istream = measure(repeats, [&] {
+      BytecodeFile  copy;
+      std::ifstream fin(path, std::ios::binary);
+      copy.load(fin);
+    });
+    Measurement decode  = measure(repeats, [&] { prog.decode(src); });
+    Measurement parse   = measure(repeats, [&] { freq.parse(prog); });
+    Measurement bytes   = measure(repeats, [&] {
+      Frequencies direct;
+      direct.parse(src, 0, src.code_size());
+    });
+    Measurement print   = measure(repeats, [&] { freq.print(null_stream); });
+
+    size_t n_bytes  = std::filesystem::file_size(path);
+    size_t n_instrs = prog.size();
+    std::printf("%s: %zu bytes, %zu instructions, %zu distinct\n", path, n_bytes, n_instrs, freq.distinct());
+    report("load", load, n_bytes, n_instrs);
+    report("istream", istream, n_bytes, n_instrs);
+    report("decode", decode, n_bytes, n_instrs);
+    report("parse", parse, n_bytes, n_instrs);
+    report("bytes", bytes, n_bytes, n_instrs);
+    report("print", print, n_bytes, n_instrs);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,2394 @@
+#pragma once
+
+// Decoding and counting of Lama bytecode, header-only, for the frequency tool (main.cpp)
+// and for anything else that loads bytecode: a virtual machine, a compiler, a linter.
+// See the Visitor section for statically dispatched decoding of every instruction
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// #####################################################################
+// ##                        Utility functions                        ##
+// #####################################################################
+
+// We don't have guarantees that our platform is little-endian,
+// which is the assumption in byterun.c, so the byte order is picked at compile time:
+// a plain unaligned load on little-endian targets, a load and a byte swap on big-endian ones,
+// and assembling from bytes when the compiler does not tell
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BYTECODE_HOST_LE 1
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BYTECODE_HOST_BE 1
+#endif
+
+inline int32_t get_i32_le(const char *bytes) {
+#if defined(BYTECODE_HOST_LE)
+  int32_t res;
+  std::memcpy(&res, bytes, 4);
+  return res;
+#elif defined(BYTECODE_HOST_BE)
+  uint32_t res;
+  std::memcpy(&res, bytes, 4);
+  return int32_t(__builtin_bswap32(res));
+#else
+  int32_t res = 0;
+  for (int i = 0; i < 4; ++i) {
+    int byte = int(bytes[i]) & 0xFF;
+    res |= int32_t(byte) << 8 * i;
+  }
+  return res;
+#endif
+}
+
+inline uint32_t read_i32_le(std::istream &is) {
+  char bytes[4] = {};
+  is.read(bytes, 4);
+  return get_i32_le(bytes);
+}
+
+inline uint64_t get_u64_le(const char *bytes) {
+#if defined(BYTECODE_HOST_LE)
+  uint64_t res;
+  std::memcpy(&res, bytes, 8);
+  return res;
+#elif defined(BYTECODE_HOST_BE)
+  uint64_t res;
+  std::memcpy(&res, bytes, 8);
+  return __builtin_bswap64(res);
+#else
+  return uint64_t(uint32_t(get_i32_le(bytes))) | uint64_t(uint32_t(get_i32_le(bytes + 4))) << 32;
+#endif
+}
+
+// Both operands of a two-operand instruction with a single 8-byte load
+inline void get_i32x2_le(const char *bytes, int32_t &a, int32_t &b) {
+  uint64_t both = get_u64_le(bytes);
+  a             = int32_t(uint32_t(both));
+  b             = int32_t(uint32_t(both >> 32));
+}
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t h) noexcept {
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+  return h ^ (h >> 31);
+}
+
+// XXH64 by Yann Collet: four independent lanes over 32-byte stripes, several GB/s on one core
+inline uint64_t xxh64(const char *bytes, size_t n, uint64_t seed = 0) {
+  static constexpr uint64_t P1 = 11400714785074694791ull, P2 = 14029467366897019727ull,
+                            P3 = 1609587929392839161ull, P4 = 9650029242287828579ull, P5 = 2870177450012600261ull;
+
+  auto rotl  = [](uint64_t x, int r) { return x << r | x >> (64 - r); };
+  auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+  auto merge = [&](uint64_t acc, uint64_t lane) { return (acc ^ round(0, lane)) * P1 + P4; };
+
+  const char *end = bytes + n;
+  uint64_t    h;
+  if (n >= 32) {
+    uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+    for (; end - bytes >= 32; bytes += 32) {
+      v1 = round(v1, get_u64_le(bytes));
+      v2 = round(v2, get_u64_le(bytes + 8));
+      v3 = round(v3, get_u64_le(bytes + 16));
+      v4 = round(v4, get_u64_le(bytes + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+  } else {
+    h = seed + P5;
+  }
+  h += n;
+
+  for (; end - bytes >= 8; bytes += 8) h = rotl(h ^ round(0, get_u64_le(bytes)), 27) * P1 + P4;
+  if (end - bytes >= 4) {
+    h = rotl(h ^ uint64_t(uint32_t(get_i32_le(bytes))) * P1, 23) * P2 + P3;
+    bytes += 4;
+  }
+  for (; bytes < end; ++bytes) h = rotl(h ^ uint8_t(*bytes) * P5, 11) * P1;
+
+  h = (h ^ (h >> 33)) * P2;
+  h = (h ^ (h >> 29)) * P3;
+  return h ^ (h >> 32);
+}
+
+// Read-only array that either owns its elements or views memory kept alive elsewhere,
+// such as a mapped index file (see ProgramIndex)
+template <typename T> struct Column {
+  Column() = default;
+  Column(std::vector<T> &&elems) : owned(std::move(elems)), ptr(owned.data()), n(owned.size()) {}
+  Column(const T *ptr, size_t n) : ptr(ptr), n(n) {}
+
+  Column(Column &&rhs) noexcept : owned(std::move(rhs.owned)), ptr(rhs.ptr), n(rhs.n) { rhs.reset(); }
+  Column &operator=(Column &&rhs) noexcept {
+    owned = std::move(rhs.owned);
+    ptr   = rhs.ptr;
+    n     = rhs.n;
+    rhs.reset();
+    return *this;
+  }
+
+  size_t   size() const noexcept { return n; }
+  bool     empty() const noexcept { return n == 0; }
+  const T *data() const noexcept { return ptr; }
+  const T *begin() const noexcept { return ptr; }
+  const T *end() const noexcept { return ptr + n; }
+  const T &operator[](size_t i) const noexcept { return ptr[i]; }
+
+  // Empties the column and hands back its owned storage, if any, to be refilled
+  std::vector<T> release() noexcept {
+    std::vector<T> res = std::move(owned);
+    reset();
+    res.clear();
+    return res;
+  }
+
+private:
+  std::vector<T> owned;
+  const T       *ptr = nullptr;
+  size_t         n   = 0;
+
+  void reset() noexcept {
+    owned.clear();
+    ptr = nullptr;
+    n   = 0;
+  }
+};
+
+// A CLOSURE capture: where the captured variable lives (G/L/A/C) and its index
+struct Capture {
+  uint8_t kind;
+  int32_t index;
+};
+
+// Decodes n [BYTE, INT] capture pairs starting at bytes into out
+inline void decode_captures(const char *bytes, size_t n, Capture *out) {
+  for (size_t i = 0; i < n; ++i, bytes += 5) out[i] = {uint8_t(bytes[0]), get_i32_le(bytes + 1)};
+}
+
+// Formats into a large reusable buffer and hands it to the stream in big writes,
+// instead of going through operator<< and stream state for every field
+struct OutputBuffer {
+  explicit OutputBuffer(std::ostream &os, size_t capacity = 1 << 16) : os(&os), buf(capacity) {}
+  explicit OutputBuffer(std::string &str, size_t capacity = 1 << 10) : str(&str), buf(capacity) {}
+  OutputBuffer(const OutputBuffer &)            = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  ~OutputBuffer() { flush(); }
+
+  void put(char c) {
+    if (pos == buf.size()) flush();
+    buf[pos++] = c;
+  }
+
+  void write(std::string_view str) {
+    if (str.empty()) return; // an empty view may have no data at all, which memcpy must not be given
+    if (pos + str.size() > buf.size()) {
+      flush();
+      if (str.size() > buf.size()) {
+        sink(str.data(), str.size());
+        return;
+      }
+    }
+    std::memcpy(buf.data() + pos, str.data(), str.size());
+    pos += str.size();
+  }
+
+  void write_int(int64_t x) { pos = std::to_chars(reserve(20), buf.data() + buf.size(), x).ptr - buf.data(); }
+  void write_uint(uint64_t x) { pos = std::to_chars(reserve(20), buf.data() + buf.size(), x).ptr - buf.data(); }
+
+  // Exactly 8 lowercase digits, as printed by std::setw(8) << std::setfill('0') << std::hex
+  void write_hex8(uint32_t x) {
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    char                 *p        = reserve(8);
+    for (int i = 7; i >= 0; --i, x >>= 4) p[i] = DIGITS[x & 15];
+    pos += 8;
+  }
+
+  // Two lowercase hex digits per byte, in order
+  void write_hex_bytes(const char *bytes, size_t n) {
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t byte = bytes[i];
+      put(DIGITS[byte >> 4]);
+      put(DIGITS[byte & 15]);
+    }
+  }
+
+  // Fixed-width little-endian integer, as in the bytecode file
+  void write_le(uint64_t x, int n_bytes) {
+    char *p = reserve(n_bytes);
+    for (int i = 0; i < n_bytes; ++i) p[i] = char(x >> 8 * i);
+    pos += n_bytes;
+  }
+
+  // JSON string contents, without the surrounding quotes
+  void write_json_escaped(std::string_view text) {
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    for (char c : text) {
+      switch (c) {
+      case '"': write("\\\""); break;
+      case '\\': write("\\\\"); break;
+      case '\n': write("\\n"); break;
+      case '\t': write("\\t"); break;
+      default:
+        if (uint8_t(c) < 0x20) {
+          write("\\u00");
+          put(DIGITS[c >> 4]);
+          put(DIGITS[c & 15]);
+        } else {
+          put(c);
+        }
+      }
+    }
+  }
+
+  // CSV field, always quoted
+  void write_csv_quoted(std::string_view text) {
+    put('"');
+    for (char c : text) {
+      if (c == '"') put('"');
+      put(c);
+    }
+    put('"');
+  }
+
+  void flush() {
+    if (pos != 0) sink(buf.data(), pos);
+    pos = 0;
+  }
+
+private:
+  std::ostream     *os  = nullptr;
+  std::string      *str = nullptr;
+  std::vector<char> buf;
+  size_t            pos = 0;
+
+  void sink(const char *data, size_t n) {
+    if (os) {
+      os->write(data, n);
+    } else {
+      str->append(data, n);
+    }
+  }
+
+  // Makes room for n more bytes and returns where they go
+  char *reserve(size_t n) {
+    if (pos + n > buf.size()) flush();
+    return buf.data() + pos;
+  }
+};
+
+// #####################################################################
+// ##                         Instrumentation                         ##
+// #####################################################################
+
+// Wall time, work done and allocations of every phase, per thread. Compiled in with
+// -DBYTECODE_INSTRUMENT (make instrument) and reported by --stats; otherwise every hook is empty.
+// Phases nest, and each one only counts what was not spent in the phases inside of it
+enum Phase : uint8_t {
+  PHASE_LOAD,
+  PHASE_DECODE,
+  PHASE_COUNT,
+  PHASE_EXECUTE,
+  PHASE_MERGE,
+  PHASE_SORT,
+  PHASE_OUTPUT,
+  N_PHASES
+};
+
+constexpr const char *PHASE_NAMES[N_PHASES] = {"load", "decode", "count", "execute", "merge", "sort", "output"};
+
+// Bumped by the operator new of alloc_hooks.hpp, in programs that include it
+inline thread_local uint64_t thread_allocations     = 0;
+inline thread_local uint64_t thread_allocated_bytes = 0;
+
+#ifdef BYTECODE_INSTRUMENT
+struct PhaseTotals {
+  uint64_t calls       = 0;
+  uint64_t ns          = 0;
+  uint64_t bytes       = 0;
+  uint64_t instrs      = 0;
+  uint64_t allocations = 0;
+  uint64_t allocated   = 0;
+
+  void add(const PhaseTotals &other) {
+    calls += other.calls;
+    ns += other.ns;
+    bytes += other.bytes;
+    instrs += other.instrs;
+    allocations += other.allocations;
+    allocated += other.allocated;
+  }
+};
+
+// Threads register on first use and stay registered, so that the report still sees joined workers
+struct Instrumentation {
+  using Totals = std::array<PhaseTotals, N_PHASES>;
+
+  static Totals &local() {
+    thread_local Totals *mine = nullptr;
+    if (!mine) {
+      Instrumentation &inst = get();
+      std::lock_guard  lock(inst.mutex);
+      mine = &inst.threads.emplace_back();
+    }
+    return *mine;
+  }
+
+  static void print(std::ostream &os) {
+    Instrumentation &inst = get();
+    std::lock_guard  lock(inst.mutex);
+    Totals           total;
+    for (const Totals &t : inst.threads)
+      for (size_t p = 0; p < N_PHASES; ++p) total[p].add(t[p]);
+
+    os << "phase      calls         ms       MB/s     Minstr     Minstr/s     allocs        bytes\n";
+    for (size_t p = 0; p < N_PHASES; ++p) print_row(os, PHASE_NAMES[p], total[p]);
+    if (inst.threads.size() > 1) {
+      for (size_t i = 0; i < inst.threads.size(); ++i) {
+        os << "thread " << i << ":";
+        for (size_t p = 0; p < N_PHASES; ++p) {
+          if (inst.threads[i][p].calls != 0)
+            os << ' ' << PHASE_NAMES[p] << ' ' << inst.threads[i][p].ns / 1e6 << " ms";
+        }
+        os << '\n';
+      }
+    }
+
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    os << "peak RSS: " << usage.ru_maxrss / 1024.0 << " MB\n";
+  }
+
+private:
+  std::mutex         mutex;
+  std::deque<Totals> threads; // does not move its elements
+
+  static Instrumentation &get() {
+    static Instrumentation inst;
+    return inst;
+  }
+
+  static void print_row(std::ostream &os, const char *name, const PhaseTotals &t) {
+    if (t.calls == 0) return;
+    double seconds = t.ns / 1e9;
+    char   row[160];
+    std::snprintf(row,
+                  sizeof(row),
+                  "%-8s %7" PRIu64 " %10.3f %10.1f %10.3f %12.2f %10" PRIu64 " %12" PRIu64 "\n",
+                  name,
+                  t.calls,
+                  t.ns / 1e6,
+                  seconds > 0 ? t.bytes / seconds / 1e6 : 0.0,
+                  t.instrs / 1e6,
+                  seconds > 0 ? t.instrs / seconds / 1e6 : 0.0,
+                  t.allocations,
+                  t.allocated);
+    os << row;
+  }
+};
+
+struct ScopedPhase {
+  explicit ScopedPhase(Phase phase) noexcept
+      : phase(phase), parent(current), start(std::chrono::steady_clock::now()),
+        allocations_start(thread_allocations), allocated_start(thread_allocated_bytes) {
+    current = this;
+  }
+
+  ScopedPhase(const ScopedPhase &)            = delete;
+  ScopedPhase &operator=(const ScopedPhase &) = delete;
+
+  ~ScopedPhase() {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                      .count();
+    uint64_t allocations = thread_allocations - allocations_start;
+    uint64_t allocated   = thread_allocated_bytes - allocated_start;
+    current              = parent;
+
+    PhaseTotals &t = Instrumentation::local()[phase];
+    t.calls++;
+    t.ns += ns - children.ns;
+    t.bytes += work.bytes;
+    t.instrs += work.instrs;
+    t.allocations += allocations - children.allocations;
+    t.allocated += allocated - children.allocated;
+    if (parent) {
+      parent->children.ns += ns;
+      parent->children.allocations += allocations;
+      parent->children.allocated += allocated;
+    }
+  }
+
+  void add_work(size_t bytes, size_t instrs) noexcept {
+    work.bytes += bytes;
+    work.instrs += instrs;
+  }
+
+private:
+  inline static thread_local ScopedPhase *current = nullptr;
+
+  Phase                                 phase;
+  ScopedPhase                          *parent;
+  std::chrono::steady_clock::time_point start;
+  uint64_t                              allocations_start, allocated_start;
+  PhaseTotals                           work, children;
+};
+#else
+struct ScopedPhase {
+  explicit ScopedPhase(Phase) noexcept {}
+  void add_work(size_t, size_t) noexcept {}
+};
+
+struct Instrumentation {
+  static void print(std::ostream &) {}
+};
+#endif
+
+// #####################################################################
+// ##                        Raw bytecode file                        ##
+// #####################################################################
+
+struct Instruction;
+
+// NUL-terminated strings addressed by their byte offset, as in the bytecode string table.
+// Tables indexed at load (see StringIndex) also know every length and which offsets hold equal strings
+struct StringTable {
+  const char     *data      = nullptr;
+  size_t          size      = 0;
+  const uint32_t *lengths   = nullptr; // of the string at each offset
+  const uint32_t *canonical = nullptr; // lowest offset of an equal string, for each offset
+
+  const char *get_str(size_t off) const {
+    if (off >= size) throw std::runtime_error("String virtual address out of bounds");
+    return data + off;
+  }
+
+  std::string_view get_view(size_t off) const {
+    const char *str = get_str(off);
+    return {str, lengths ? lengths[off] : std::strlen(str)};
+  }
+
+  // Offsets must be in bounds, as for the STR operand of a validated instruction
+  uint32_t canonical_of(uint32_t off) const noexcept { return canonical ? canonical[off] : off; }
+};
+
+// Per-offset lengths and canonical offsets of a string table, computed once at load.
+// Offsets inside a string are their own canonical offset, as compilers only ever point at string starts.
+// Rebuilding reuses the storage of the previous table
+struct StringIndex {
+  std::vector<uint32_t> lengths;
+  std::vector<uint32_t> canonical;
+
+  void build(const char *data, size_t size) {
+    lengths.resize(size);
+    canonical.resize(size);
+    uint32_t len = 0;
+    for (size_t off = size; off-- > 0;) {
+      len            = data[off] == 0 ? 0 : len + 1;
+      lengths[off]   = len;
+      canonical[off] = uint32_t(off);
+    }
+
+    // Equal strings end up next to each other, the lowest offset first
+    auto str = [&](uint32_t off) { return std::string_view(data + off, lengths[off]); };
+    starts.clear();
+    for (size_t off = 0; off < size; off += lengths[off] + 1) starts.push_back(uint32_t(off));
+    std::sort(starts.begin(), starts.end(), [&](uint32_t a, uint32_t b) {
+      return str(a) != str(b) ? str(a) < str(b) : a < b;
+    });
+    for (size_t i = 1; i < starts.size(); ++i) {
+      if (str(starts[i]) == str(starts[i - 1])) canonical[starts[i]] = canonical[starts[i - 1]];
+    }
+  }
+
+  StringTable view(const char *data, size_t size) const noexcept {
+    return {data, size, lengths.data(), canonical.data()};
+  }
+
+private:
+  std::vector<uint32_t> starts; // of the strings, sorted by contents
+};
+
+struct BytecodeFile {
+  uint32_t stringtab_size        = 0;
+  uint32_t global_area_size      = 0;
+  uint32_t public_symbols_number = 0;
+
+  BytecodeFile() = default;
+  BytecodeFile(const BytecodeFile &) = delete;
+  BytecodeFile &operator=(const BytecodeFile &) = delete;
+  ~BytecodeFile() { unmap(); }
+
+  // Fallback path for pipes and other non-seekable streams
+  void load(std::istream &is) {
+    ScopedPhase phase(PHASE_LOAD);
+    read(is);
+    phase.add_work(size(), 0);
+  }
+
+  // Maps regular files directly, so that instructions point into the page cache
+  // instead of a heap copy; anything that cannot be mapped goes through load(istream)
+  void load_file(const char *path) {
+    ScopedPhase phase(PHASE_LOAD);
+    unmap();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) throw std::runtime_error(std::string("Cannot open ") + path + ": " + std::strerror(errno));
+
+    struct stat st = {};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= 12) {
+      void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        close(fd);
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        mapping      = static_cast<const char *>(addr);
+        mapping_size = st.st_size;
+
+        stringtab_size        = get_i32_le(mapping);
+        global_area_size      = get_i32_le(mapping + 4);
+        public_symbols_number = get_i32_le(mapping + 8);
+        data                  = mapping + 12;
+        data_size             = mapping_size - 12;
+        validate();
+        phase.add_work(size(), 0);
+        return;
+      }
+    }
+    close(fd);
+
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) throw std::runtime_error(std::string("Cannot open ") + path);
+    read(fin);
+    phase.add_work(size(), 0);
+  }
+
+  // Views the whole contents of a file read elsewhere, e.g. ahead of time by another thread;
+  // the caller keeps them alive and unchanged as long as this file is in use
+  void load_bytes(const char *contents, size_t n) {
+    ScopedPhase phase(PHASE_LOAD);
+    unmap();
+    if (n < 12) throw std::runtime_error("IO error");
+    stringtab_size        = get_i32_le(contents);
+    global_area_size      = get_i32_le(contents + 4);
+    public_symbols_number = get_i32_le(contents + 8);
+    data                  = contents + 12;
+    data_size             = n - 12;
+    validate();
+    phase.add_work(size(), 0);
+  }
+
+  size_t size() const noexcept { return data_size; }
+  size_t code_size() const noexcept { return size() - code_start; }
+
+  // Start of the code section, for accessors that have validated offsets already
+  const char *code() const noexcept { return data + code_start; }
+
+  // Checked accessors: every call validates what it reads, see Instruction::validate
+  Instruction get_instr(size_t offset) const;
+
+  // Unchecked accessors, for offsets that a validating pass (DecodedProgram::decode,
+  // chunk_boundaries) has already proven to be instruction boundaries
+  Instruction get_instr_unchecked(size_t offset) const noexcept;
+  int32_t     get_int_unchecked(size_t off) const noexcept { return get_i32_le(code() + off); }
+
+  char get_byte(size_t off) const {
+    if (off >= code_size()) throw std::runtime_error("EOF");
+    return data[code_start + off];
+  }
+
+  int32_t get_int(size_t off) const {
+    if (off + 4 > code_size()) throw std::runtime_error("EOF");
+    uint32_t res = get_i32_le(&data[code_start + off]);
+    off += 4;
+    return res;
+  }
+
+  const char *get_str(size_t off) const { return strings().get_str(off); }
+
+  StringTable strings() const noexcept { return string_index.view(data + stringtab_start, stringtab_size); }
+
+  // XXH64 of the header fields and everything after them
+  uint64_t content_hash(uint64_t seed = 0) const noexcept {
+    uint64_t header = uint64_t(stringtab_size) | uint64_t(global_area_size) << 32;
+    return mix64(xxh64(data, data_size, seed ^ public_symbols_number) ^ header);
+  }
+
+  struct PublicSymbol {
+    const char *name;
+    uint32_t    offset; // in the code section, not checked to be an instruction boundary
+  };
+
+  // Each entry of the table is a name in the string table followed by a code offset
+  PublicSymbol get_public_symbol(size_t i) const {
+    if (i >= public_symbols_number) throw std::runtime_error("Public symbol index out of bounds");
+    const char *entry = data + public_symbols_start + 8 * i;
+    return {get_str(uint32_t(get_i32_le(entry))), uint32_t(get_i32_le(entry + 4))};
+  }
+
+private:
+  std::vector<char> bytes;
+  const char       *mapping      = nullptr;
+  size_t            mapping_size = 0;
+
+  // Everything after the header, either in `bytes` or in `mapping`
+  const char *data      = nullptr;
+  size_t      data_size = 0;
+
+  size_t public_symbols_start = 0;
+  size_t stringtab_start      = 0;
+  size_t code_start           = 0;
+
+  StringIndex string_index;
+
+  void validate() {
+    public_symbols_start = 0;
+    stringtab_start      = public_symbols_start + 8 * size_t(public_symbols_number);
+    code_start           = stringtab_start + stringtab_size;
+
+    if (stringtab_start >= data_size) throw std::runtime_error("Incorrect metadata: public_symbols_number");
+
+    if (code_start >= data_size) throw std::runtime_error("Incorrect metadata: stringtab_size");
+
+    if (stringtab_size != 0 && data[stringtab_start + stringtab_size - 1] != 0)
+      throw std::runtime_error("Last string in table is not null-terminated");
+    string_index.build(data + stringtab_start, stringtab_size);
+  }
+
+  void read(std::istream &is) {
+    unmap();
+    stringtab_size        = read_i32_le(is);
+    global_area_size      = read_i32_le(is);
+    public_symbols_number = read_i32_le(is);
+    if (!is.good()) throw std::runtime_error("IO error");
+
+    // Bulk reads instead of istreambuf_iterator, which costs a virtual call per byte
+    bytes.clear();
+    char buf[1 << 16];
+    while (is.read(buf, sizeof(buf)) || is.gcount() > 0) bytes.insert(bytes.end(), buf, buf + is.gcount());
+    if (is.bad()) throw std::runtime_error("IO error");
+
+    data      = bytes.data();
+    data_size = bytes.size();
+    validate();
+  }
+
+  void unmap() {
+    if (mapping) munmap(const_cast<char *>(mapping), mapping_size);
+    mapping      = nullptr;
+    mapping_size = 0;
+    data         = nullptr;
+    data_size    = 0;
+  }
+};
+
+// #####################################################################
+// ##                      Bytecode instruction                       ##
+// #####################################################################
+// Opcodes:
+// 0xF_ => STOP
+// 0x01 => BINOP +
+// 0x02 => BINOP -
+// 0x03 => BINOP *
+// 0x04 => BINOP /
+// 0x05 => BINOP %
+// 0x06 => BINOP <
+// 0x07 => BINOP <=
+// 0x08 => BINOP >
+// 0x09 => BINOP >=
+// 0x0A => BINOP ==
+// 0x0B => BINOP !=
+// 0x0C => BINOP &&
+// 0x0D => BINOP !!
+// 0x10 => CONST INT
+// 0x11 => STRING STR
+// 0x12 => SEXP STR INT
+// 0x13 => STI
+// 0x14 => STA
+// 0x15 => JMP INT
+// 0x16 => END
+// 0x17 => RET
+// 0x18 => DROP
+// 0x19 => DUP
+// 0x1A => SWAP
+// 0x1B => ELEM
+// 0x20 => LD G(INT)
+// 0x21 => LD L(INT)
+// 0x22 => LD A(INT)
+// 0x23 => LD C(INT)
+// 0x30 => LDA G(INT)
+// 0x31 => LDA L(INT)
+// 0x32 => LDA A(INT)
+// 0x33 => LDA C(INT)
+// 0x40 => ST G(INT)
+// 0x41 => ST L(INT)
+// 0x42 => ST A(INT)
+// 0x43 => ST C(INT)
+// 0x50 => CJMPz INT
+// 0x51 => CJMPnz INT
+// 0x52 => BEGIN INT INT
+// 0x53 => CBEGIN INT INT
+// 0x54 => CLOSURE INT (INT x [BYTE, INT])
+// 0x55 => CALLC INT
+// 0x56 => CALL INT INT
+// 0x57 => TAG STR INT
+// 0x58 => ARRAY INT
+// 0x59 => FAIL INT INT
+// 0x5A => LINE INT
+// 0x60 => PATT =str
+// 0x61 => PATT #string
+// 0x62 => PATT #array
+// 0x63 => PATT #sexp
+// 0x64 => PATT #ref
+// 0x65 => PATT #val
+// 0x66 => PATT #fun
+// 0x70 => CALL Lread
+// 0x71 => CALL Lwrite
+// 0x72 => CALL Llength
+// 0x73 => CALL Lstring
+// 0x74 => CALL Barray INT
+
+// How the operand bytes after the opcode are laid out and printed
+enum class Operands : uint8_t {
+  NONE,     // mnemonic only
+  INT,      // mnemonic INT
+  INT_INT,  // mnemonic INT ' ' INT
+  HEX,      // mnemonic HEX8
+  HEX_INT,  // mnemonic HEX8 ' ' INT
+  STR_INT,  // mnemonic STR ' ' INT
+  LOC,      // mnemonic INT ')', mnemonic already includes the "X(" part
+  CLOSURE,  // mnemonic HEX8 INT x (' ' X '(' INT ')')
+};
+
+struct OpcodeInfo {
+  std::string_view mnemonic;     // including the separator before the first operand
+  uint8_t          size     = 0; // for CLOSURE, size without the captures
+  Operands         operands = Operands::NONE;
+  bool             valid    = false;
+};
+
+constexpr std::array<OpcodeInfo, 256> make_opcode_table() {
+  std::array<OpcodeInfo, 256> t = {};
+
+  auto def = [&t](int code, const char *mnemonic, Operands operands) {
+    uint8_t size = 1;
+    switch (operands) {
+    case Operands::NONE: size = 1; break;
+    case Operands::INT:
+    case Operands::HEX:
+    case Operands::LOC: size = 5; break;
+    case Operands::INT_INT:
+    case Operands::HEX_INT:
+    case Operands::STR_INT:
+    case Operands::CLOSURE: size = 9; break;
+    }
+    t[code] = {mnemonic, size, operands, true};
+  };
+
+  const char *const binops[] = {"BINOP +",
+                                "BINOP -",
+                                "BINOP *",
+                                "BINOP /",
+                                "BINOP %",
+                                "BINOP <",
+                                "BINOP <=",
+                                "BINOP >",
+                                "BINOP >=",
+                                "BINOP ==",
+                                "BINOP !=",
+                                "BINOP &&",
+                                "BINOP !!"};
+  for (int i = 0; i < 13; ++i) def(0x01 + i, binops[i], Operands::NONE);
+
+  def(0x10, "CONST ", Operands::INT);
+  def(0x11, "STRING ", Operands::INT);
+  def(0x12, "SEXP\t", Operands::STR_INT);
+  def(0x13, "STI", Operands::NONE);
+  def(0x14, "STA", Operands::NONE);
+  def(0x15, "JMP\t0x", Operands::HEX);
+  def(0x16, "END", Operands::NONE);
+  def(0x17, "RET", Operands::NONE);
+  def(0x18, "DROP", Operands::NONE);
+  def(0x19, "DUP", Operands::NONE);
+  def(0x1A, "SWAP", Operands::NONE);
+  def(0x1B, "ELEM", Operands::NONE);
+
+  const char *const locs[3][4] = {
+      {"LD\tG(", "LD\tL(", "LD\tA(", "LD\tC("},
+      {"LDA\tG(", "LDA\tL(", "LDA\tA(", "LDA\tC("},
+      {"ST\tG(", "ST\tL(", "ST\tA(", "ST\tC("},
+  };
+  for (int hi = 0; hi < 3; ++hi)
+    for (int lo = 0; lo < 4; ++lo) def(0x20 + 0x10 * hi + lo, locs[hi][lo], Operands::LOC);
+
+  def(0x50, "CJMPz\t0x", Operands::HEX);
+  def(0x51, "CJMPnz\t0x", Operands::HEX);
+  def(0x52, "BEGIN\t", Operands::INT_INT);
+  def(0x53, "CBEGIN\t", Operands::INT_INT);
+  def(0x54, "CLOSURE\t", Operands::CLOSURE);
+  def(0x55, "CALLC\t", Operands::INT);
+  def(0x56, "CALL\t0x", Operands::HEX_INT);
+  def(0x57, "TAG\t", Operands::STR_INT);
+  def(0x58, "ARRAY\t", Operands::INT);
+  def(0x59, "FAIL\t", Operands::INT_INT);
+  def(0x5A, "LINE\t", Operands::INT);
+
+  const char *const patterns[] = {
+      "PATT\t=str", "PATT\t#string", "PATT\t#array", "PATT\t#sexp", "PATT\t#ref", "PATT\t#val", "PATT\t#fun"};
+  for (int i = 0; i < 7; ++i) def(0x60 + i, patterns[i], Operands::NONE);
+
+  def(0x70, "CALL\tLread", Operands::NONE);
+  def(0x71, "CALL\tLwrite", Operands::NONE);
+  def(0x72, "CALL\tLlength", Operands::NONE);
+  def(0x73, "CALL\tLstring", Operands::NONE);
+  def(0x74, "CALL\tBarray\t", Operands::INT);
+
+  for (int lo = 0; lo < 16; ++lo) def(0xF0 + lo, "<end>", Operands::NONE);
+
+  return t;
+}
+
+// Single source of truth for sizes, validity and printing of every opcode
+inline constexpr std::array<OpcodeInfo, 256> OPCODES = make_opcode_table();
+
+constexpr uint8_t OP_CLOSURE = 0x54;
+
+// References bytecode file, therefore it must be alive
+// for the entire lifetime of the instruction
+struct Instruction {
+  // The size comes from validate or from an already validated source
+  Instruction(const char *start, uint32_t len) : start(start), len(len) {}
+
+  size_t size() const noexcept { return len; }
+
+  static size_t decode_size(const char *start) {
+    const OpcodeInfo &info = OPCODES[uint8_t(*start)];
+    if (!info.valid) throw std::runtime_error("Invalid opcode");
+    // CLOSURE INT (INT x [BYTE, INT]) is the only variable-length instruction
+    if (info.operands == Operands::CLOSURE) return info.size + 5 * get_i32_le(start + 5);
+    return info.size;
+  }
+
+  // Size of an instruction that is known to be valid, without any checks
+  static size_t decode_size_unchecked(const char *start) noexcept {
+    const OpcodeInfo &info = OPCODES[uint8_t(*start)];
+    if (info.operands == Operands::CLOSURE) return info.size + 5 * get_i32_le(start + 5);
+    return info.size;
+  }
+
+  // Proves what the unchecked accessors rely on and returns the size of the instruction:
+  // the opcode is valid, the instruction lies within limit, the CLOSURE captures are well-formed
+  // and the STR operand is inside the string table
+  static size_t validate(const char *start, size_t limit, size_t stringtab_size) {
+    const OpcodeInfo &info = OPCODES[uint8_t(*start)];
+    if (!info.valid) throw std::runtime_error("Invalid opcode");
+    if (info.size > limit) throw std::runtime_error("EOF");
+
+    switch (info.operands) {
+    case Operands::CLOSURE: {
+      int32_t n = get_i32_le(start + 5);
+      if (n < 0) throw std::runtime_error("Invalid CLOSURE");
+      if (size_t(n) > (limit - info.size) / 5) throw std::runtime_error("EOF");
+      for (int32_t i = 0; i < n; ++i)
+        if (uint8_t(start[9 + 5 * i]) >= 4) throw std::runtime_error("Invalid CLOSURE");
+      return info.size + 5 * size_t(n);
+    }
+    case Operands::STR_INT:
+      if (uint32_t(get_i32_le(start + 1)) >= stringtab_size)
+        throw std::runtime_error("String virtual address out of bounds");
+      return info.size;
+    default: return info.size;
+    }
+  }
+
+  // Helper function to prevent UB in BytecodeFile
+  static bool fits_in_size(const char *start, size_t limit) {
+    // Special case for CLOSURE,
+    // as its size is not known from the first byte
+    if (OPCODES[uint8_t(*start)].operands == Operands::CLOSURE && limit < 9) return false;
+    return decode_size(start) <= limit;
+  }
+
+  const char *data() const noexcept { return start; }
+  uint8_t     opcode() const noexcept { return uint8_t(*start); }
+
+  void print(const StringTable &strings, OutputBuffer &out) const {
+    static constexpr std::string_view CAPTURES[] = {" G(", " L(", " A(", " C("};
+
+    const OpcodeInfo &info = OPCODES[opcode()];
+    if (!info.valid) throw std::runtime_error("Invalid opcode");
+
+    out.write(info.mnemonic);
+    switch (info.operands) {
+    case Operands::NONE: break;
+    case Operands::INT: out.write_int(get_int(1)); break;
+    case Operands::INT_INT:
+      out.write_int(get_int(1));
+      out.put(' ');
+      out.write_int(get_int(5));
+      break;
+    case Operands::HEX: out.write_hex8(get_int(1)); break;
+    case Operands::HEX_INT:
+      out.write_hex8(get_int(1));
+      out.put(' ');
+      out.write_int(get_int(5));
+      break;
+    case Operands::STR_INT:
+      out.write(get_str(strings, 1));
+      out.put(' ');
+      out.write_int(get_int(5));
+      break;
+    case Operands::LOC:
+      out.write_int(get_int(1));
+      out.put(')');
+      break;
+    case Operands::CLOSURE: {
+      out.write_hex8(get_int(1));
+      int32_t n = get_int(5);
+      for (int32_t i = 0; i < n; ++i) {
+        uint8_t kind = start[9 + 5 * i];
+        if (kind >= 4) throw std::runtime_error("Invalid CLOSURE");
+        out.write(CAPTURES[kind]);
+        out.write_int(get_int(10 + 5 * i));
+        out.put(')');
+      }
+    } break;
+    }
+  }
+
+  void print(const StringTable &strings, std::ostream &os) const {
+    OutputBuffer out(os, 256);
+    print(strings, out);
+  }
+
+  // Prints an opcode with every operand replaced by '*', e.g. "LD\tL(*)" or "CALL\t* *"
+  static void print_shape(uint8_t opcode, OutputBuffer &out) {
+    const OpcodeInfo &info = OPCODES[opcode];
+    if (!info.valid) throw std::runtime_error("Invalid opcode");
+
+    std::string_view mnemonic = info.mnemonic;
+    if (mnemonic.size() >= 2 && mnemonic.substr(mnemonic.size() - 2) == "0x") mnemonic.remove_suffix(2);
+    out.write(mnemonic);
+    switch (info.operands) {
+    case Operands::NONE: break;
+    case Operands::INT:
+    case Operands::HEX:
+    case Operands::CLOSURE: out.put('*'); break;
+    case Operands::INT_INT:
+    case Operands::HEX_INT:
+    case Operands::STR_INT: out.write("* *"); break;
+    case Operands::LOC: out.write("*)"); break;
+    }
+  }
+
+  bool operator<(const Instruction &rhs) const { return as_sv() < rhs.as_sv(); }
+  bool operator==(const Instruction &rhs) const { return as_sv() == rhs.as_sv(); }
+
+private:
+  const char *start;
+  uint32_t    len;
+
+  std::string_view as_sv() const { return std::string_view(start, size()); }
+
+  int32_t     get_int(size_t off) const { return get_i32_le(start + off); }
+  std::string_view get_str(const StringTable &strings, size_t off) const { return strings.get_view(get_int(off)); }
+
+  friend struct std::hash<Instruction>;
+};
+
+inline Instruction BytecodeFile::get_instr(size_t offset) const {
+  if (offset >= code_size()) throw std::runtime_error("EOF");
+  const char *start = &data[code_start + offset];
+  return Instruction(start, Instruction::validate(start, code_size() - offset, stringtab_size));
+}
+
+inline Instruction BytecodeFile::get_instr_unchecked(size_t offset) const noexcept {
+  const char *start = code() + offset;
+  return Instruction(start, Instruction::decode_size_unchecked(start));
+}
+
+template <> struct std::hash<Instruction> {
+  size_t operator()(const Instruction &self) const noexcept { return std::hash<std::string_view>{}(self.as_sv()); }
+};
+
+// #####################################################################
+// ##                         Decoded program                         ##
+// #####################################################################
+
+// The code section decoded once into parallel arrays,
+// so that every analysis is a linear scan instead of a variable-length decode.
+// Refers to the bytecode file, which must outlive it
+struct DecodedProgram {
+  Column<uint32_t> offsets; // of each instruction, plus the end of code as a sentinel
+  Column<uint8_t>  opcodes;
+  Column<int32_t>  arg0; // first INT/STR operand, or 0
+  Column<int32_t>  arg1; // second INT operand (number of captures for CLOSURE), or 0
+
+  // Captures of all CLOSUREs back to back: those of the k-th CLOSURE (instruction closure_instrs[k])
+  // are captures[capture_begin[k] .. capture_begin[k + 1])
+  Column<uint32_t> closure_instrs;
+  Column<uint32_t> capture_begin;
+  Column<Capture>  captures;
+
+  // Keeps the memory of viewing columns alive
+  std::shared_ptr<const void> backing;
+
+  void decode(const BytecodeFile &src) {
+    ScopedPhase phase(PHASE_DECODE);
+    pSrc = &src;
+    backing.reset();
+    // Refills the storage of the previous decode, so that decoding file after file does not allocate
+    std::vector<uint32_t> offsets        = this->offsets.release();
+    std::vector<uint8_t>  opcodes        = this->opcodes.release();
+    std::vector<int32_t>  arg0           = this->arg0.release();
+    std::vector<int32_t>  arg1           = this->arg1.release();
+    std::vector<uint32_t> closure_instrs = this->closure_instrs.release();
+    std::vector<uint32_t> capture_begin  = this->capture_begin.release();
+    std::vector<Capture>  captures       = this->captures.release();
+    capture_begin.push_back(0);
+
+    for (size_t offset = 0; offset < src.code_size();) {
+      Instruction instr = src.get_instr(offset);
+      const char *p     = instr.data();
+      int32_t     a = 0, b = 0;
+      if (instr.size() >= 9) {
+        get_i32x2_le(p + 1, a, b);
+      } else if (instr.size() >= 5) {
+        a = get_i32_le(p + 1);
+      }
+      offsets.push_back(offset);
+      opcodes.push_back(instr.opcode());
+      arg0.push_back(a);
+      arg1.push_back(b);
+
+      if (instr.opcode() == OP_CLOSURE) {
+        closure_instrs.push_back(opcodes.size() - 1);
+        captures.resize(captures.size() + b);
+        decode_captures(p + 9, b, captures.data() + captures.size() - b);
+        capture_begin.push_back(captures.size());
+      }
+      offset += instr.size();
+    }
+    offsets.push_back(src.code_size());
+
+    this->offsets        = std::move(offsets);
+    this->opcodes        = std::move(opcodes);
+    this->arg0           = std::move(arg0);
+    this->arg1           = std::move(arg1);
+    this->closure_instrs = std::move(closure_instrs);
+    this->capture_begin  = std::move(capture_begin);
+    this->captures       = std::move(captures);
+    phase.add_work(src.code_size(), size());
+  }
+
+  // Takes columns that a trusted source, an index file built by decode, has filled in
+  void attach(const BytecodeFile &src) { pSrc = &src; }
+
+  size_t              size() const noexcept { return opcodes.size(); }
+  const BytecodeFile &source() const noexcept { return *pSrc; }
+
+  uint32_t instr_size(size_t i) const noexcept { return offsets[i + 1] - offsets[i]; }
+
+  // Already validated by decode, so no bounds checks here
+  Instruction instr(size_t i) const noexcept { return Instruction(pSrc->code() + offsets[i], instr_size(i)); }
+
+  // Index of the instruction starting at a code offset, size() if none does
+  size_t index_of(uint32_t offset) const noexcept {
+    auto end = offsets.end() - 1;
+    auto it  = std::lower_bound(offsets.begin(), end, offset);
+    return it != end && *it == offset ? it - offsets.begin() : size();
+  }
+
+  // Captures of the CLOSURE at instruction i
+  std::pair<const Capture *, const Capture *> captures_of(size_t i) const noexcept {
+    size_t k = std::lower_bound(closure_instrs.begin(), closure_instrs.end(), i) - closure_instrs.begin();
+    return {captures.data() + capture_begin[k], captures.data() + capture_begin[k + 1]};
+  }
+
+private:
+  const BytecodeFile *pSrc = nullptr;
+};
+
+// #####################################################################
+// ##                             Visitor                             ##
+// #####################################################################
+
+// Statically dispatched decoding for loaders and compilers: decode(src, f) calls f(op, operands...)
+// for every instruction, where op is an Op<OPCODE> and the operands are typed after its operand kind:
+//   NONE    - none
+//   INT     - int32_t
+//   INT_INT - int32_t, int32_t
+//   HEX     - uint32_t code offset
+//   HEX_INT - uint32_t code offset, int32_t
+//   STR_INT - StrOperand, int32_t
+//   LOC     - int32_t index; the kind of location is part of the opcode
+//   CLOSURE - uint32_t code offset, Captures
+// Every opcode is a case of a single switch calling its own instantiation of f, so a generic lambda
+// costs no indirect call, and branching on the opcode inside it is resolved at compile time:
+//
+//   decode(src, [&](auto op, auto... operands) {
+//     if constexpr (op.opcode == 0x10) push_const(operands...);
+//   });
+
+template <uint8_t Code> struct Op {
+  static constexpr uint8_t          opcode   = Code;
+  static constexpr Operands         operands = OPCODES[Code].operands;
+  static constexpr std::string_view mnemonic = OPCODES[Code].mnemonic;
+
+  Instruction instr;  // the bytes, for whatever the operands do not cover
+  uint32_t    offset; // in the code section
+};
+
+// Offset into the string table; the string itself is only looked up on request
+struct StrOperand {
+  uint32_t           offset;
+  const StringTable *strings;
+
+  std::string_view view() const { return strings->get_view(offset); }
+};
+
+// The [BYTE, INT] capture pairs of a CLOSURE, decoded on access
+struct Captures {
+  const char *bytes;
+  uint32_t    n;
+
+  size_t  size() const noexcept { return n; }
+  Capture operator[](size_t i) const noexcept { return {uint8_t(bytes[5 * i]), get_i32_le(bytes + 5 * i + 1)}; }
+};
+
+template <uint8_t Code, typename F>
+void visit_as(const Instruction &instr, uint32_t offset, const StringTable &strings, F &f) {
+  constexpr Operands kind = OPCODES[Code].operands;
+  const char        *p    = instr.data();
+  Op<Code>           op{instr, offset};
+  if constexpr (!OPCODES[Code].valid) {
+    throw std::runtime_error("Invalid opcode");
+  } else if constexpr (kind == Operands::NONE) {
+    f(op);
+  } else if constexpr (kind == Operands::INT || kind == Operands::LOC) {
+    f(op, get_i32_le(p + 1));
+  } else if constexpr (kind == Operands::INT_INT) {
+    f(op, get_i32_le(p + 1), get_i32_le(p + 5));
+  } else if constexpr (kind == Operands::HEX) {
+    f(op, uint32_t(get_i32_le(p + 1)));
+  } else if constexpr (kind == Operands::HEX_INT) {
+    f(op, uint32_t(get_i32_le(p + 1)), get_i32_le(p + 5));
+  } else if constexpr (kind == Operands::STR_INT) {
+    f(op, StrOperand{uint32_t(get_i32_le(p + 1)), &strings}, get_i32_le(p + 5));
+  } else {
+    f(op, uint32_t(get_i32_le(p + 1)), Captures{p + 9, uint32_t(get_i32_le(p + 5))});
+  }
+}
+
+// Calls f for a single instruction, which must have been validated against strings,
+// e.g. one handed out by BytecodeStream::for_each_instr
+template <typename F> void visit(const Instruction &instr, uint32_t offset, const StringTable &strings, F &&f) {
+#define BYTECODE_VISIT_CASE(code)                                                                   \
+  case code: return visit_as<code>(instr, offset, strings, f);
+#define BYTECODE_VISIT_ROW(hi)                                                                      \
+  BYTECODE_VISIT_CASE(hi + 0x0) BYTECODE_VISIT_CASE(hi + 0x1) BYTECODE_VISIT_CASE(hi + 0x2)         \
+  BYTECODE_VISIT_CASE(hi + 0x3) BYTECODE_VISIT_CASE(hi + 0x4) BYTECODE_VISIT_CASE(hi + 0x5)         \
+  BYTECODE_VISIT_CASE(hi + 0x6) BYTECODE_VISIT_CASE(hi + 0x7) BYTECODE_VISIT_CASE(hi + 0x8)         \
+  BYTECODE_VISIT_CASE(hi + 0x9) BYTECODE_VISIT_CASE(hi + 0xA) BYTECODE_VISIT_CASE(hi + 0xB)         \
+  BYTECODE_VISIT_CASE(hi + 0xC) BYTECODE_VISIT_CASE(hi + 0xD) BYTECODE_VISIT_CASE(hi + 0xE)         \
+  BYTECODE_VISIT_CASE(hi + 0xF)
+
+  switch (instr.opcode()) {
+    BYTECODE_VISIT_ROW(0x00)
+    BYTECODE_VISIT_ROW(0x10)
+    BYTECODE_VISIT_ROW(0x20)
+    BYTECODE_VISIT_ROW(0x30)
+    BYTECODE_VISIT_ROW(0x40)
+    BYTECODE_VISIT_ROW(0x50)
+    BYTECODE_VISIT_ROW(0x60)
+    BYTECODE_VISIT_ROW(0x70)
+    BYTECODE_VISIT_ROW(0x80)
+    BYTECODE_VISIT_ROW(0x90)
+    BYTECODE_VISIT_ROW(0xA0)
+    BYTECODE_VISIT_ROW(0xB0)
+    BYTECODE_VISIT_ROW(0xC0)
+    BYTECODE_VISIT_ROW(0xD0)
+    BYTECODE_VISIT_ROW(0xE0)
+    BYTECODE_VISIT_ROW(0xF0)
+  }
+
+#undef BYTECODE_VISIT_ROW
+#undef BYTECODE_VISIT_CASE
+}
+
+// Every instruction of the code section, each validated before f sees it
+template <typename F> void decode(const BytecodeFile &src, F &&f) {
+  StringTable strings = src.strings();
+  for (size_t offset = 0; offset < src.code_size();) {
+    Instruction instr = src.get_instr(offset);
+    visit(instr, uint32_t(offset), strings, f);
+    offset += instr.size();
+  }
+}
+
+// The instructions in [begin, end) of a code section validated before, e.g. by DecodedProgram::decode;
+// begin must be an instruction boundary, and the last instruction may extend past end
+template <typename F> void decode_unchecked(const BytecodeFile &src, size_t begin, size_t end, F &&f) {
+  StringTable strings = src.strings();
+  for (size_t offset = begin; offset < end;) {
+    Instruction instr = src.get_instr_unchecked(offset);
+    visit(instr, uint32_t(offset), strings, f);
+    offset += instr.size();
+  }
+}
+
+// #####################################################################
+// ##                         Streaming input                         ##
+// #####################################################################
+
+// Reads bytecode from a stream keeping only the header, public symbols and string table,
+// so that memory use does not depend on the size of the code section
+struct BytecodeStream {
+  uint32_t stringtab_size        = 0;
+  uint32_t global_area_size      = 0;
+  uint32_t public_symbols_number = 0;
+
+  static constexpr size_t DEFAULT_CHUNK = 1 << 16;
+
+  void open(std::istream &is) {
+    ScopedPhase phase(PHASE_LOAD);
+    pIs                   = &is;
+    stringtab_size        = read_i32_le(is);
+    global_area_size      = read_i32_le(is);
+    public_symbols_number = read_i32_le(is);
+    if (!is.good()) throw std::runtime_error("IO error");
+
+    size_t stringtab_start = 8 * size_t(public_symbols_number);
+    meta.clear();
+    if (!read_meta(stringtab_start)) throw std::runtime_error("Incorrect metadata: public_symbols_number");
+    if (!read_meta(stringtab_size)) throw std::runtime_error("Incorrect metadata: stringtab_size");
+
+    if (stringtab_size != 0 && meta.back() != 0)
+      throw std::runtime_error("Last string in table is not null-terminated");
+    string_index.build(meta.data() + stringtab_start, stringtab_size);
+  }
+
+  StringTable strings() const noexcept {
+    return string_index.view(meta.data() + 8 * size_t(public_symbols_number), stringtab_size);
+  }
+
+  // Calls f(instr) for every instruction of the code section, reading it chunk_size bytes at a time.
+  // Instructions only stay valid during the call; one straddling the end of a chunk is moved
+  // to the front of the buffer, and the buffer grows only if a single CLOSURE does not fit
+  template <typename F> void for_each_instr(F &&f, size_t chunk_size = DEFAULT_CHUNK) {
+    std::vector<char> buf(chunk_size);
+    size_t            have   = 0; // bytes in buf
+    size_t            pos    = 0; // bytes of buf already decoded
+    bool              eof    = false;
+    size_t            n_read = 0;
+
+    for (;;) {
+      std::memmove(buf.data(), buf.data() + pos, have - pos);
+      have -= pos;
+      pos = 0;
+      if (!eof) {
+        pIs->read(buf.data() + have, buf.size() - have);
+        have += pIs->gcount();
+        n_read += pIs->gcount();
+        if (pIs->bad()) throw std::runtime_error("IO error");
+        eof = pIs->eof();
+      }
+      if (n_read == 0) throw std::runtime_error("Incorrect metadata: stringtab_size");
+
+      while (pos < have) {
+        const char *start = buf.data() + pos;
+        size_t      limit = have - pos;
+        if (!Instruction::fits_in_size(start, limit)) {
+          if (eof) throw std::runtime_error("EOF");
+          // The CLOSURE header is needed to know its full size
+          bool   closure = OPCODES[uint8_t(*start)].operands == Operands::CLOSURE;
+          size_t need    = closure && limit < 9 ? 9 : Instruction::decode_size(start);
+          if (need > INT32_MAX) throw std::runtime_error("Invalid CLOSURE");
+          if (need > buf.size()) buf.resize(need);
+          break;
+        }
+        Instruction instr(start, Instruction::validate(start, limit, stringtab_size));
+        f(instr);
+        pos += instr.size();
+      }
+      if (eof && pos == have) return;
+    }
+  }
+
+private:
+  std::istream     *pIs = nullptr;
+  std::vector<char> meta; // public symbols and string table
+  StringIndex       string_index;
+
+  // Appends n bytes of the input to meta a chunk at a time, so that meta grows with what was read
+  // rather than with what a corrupt header claims; false if the input ends first
+  bool read_meta(size_t n) {
+    while (n > 0) {
+      size_t start = meta.size(), step = std::min(n, DEFAULT_CHUNK);
+      meta.resize(start + step);
+      pIs->read(meta.data() + start, step);
+      if (size_t(pIs->gcount()) != step) {
+        meta.resize(start + size_t(pIs->gcount()));
+        return false;
+      }
+      n -= step;
+    }
+    return true;
+  }
+};
+
+// #####################################################################
+// ##                      Counting instructions                      ##
+// #####################################################################
+
+// Every instruction but CLOSURE is at most 9 bytes long,
+// so it is identified by its opcode and the next 8 bytes read as a little-endian word
+struct PackedKey {
+  uint64_t operands = 0;
+  uint8_t  opcode   = 0;
+
+  static PackedKey of(const Instruction &instr) {
+    PackedKey key;
+    key.opcode = instr.opcode();
+    if (instr.size() >= 9) {
+      key.operands = get_u64_le(instr.data() + 1);
+    } else if (instr.size() >= 5) {
+      key.operands = uint32_t(get_i32_le(instr.data() + 1));
+    }
+    return key;
+  }
+
+  // The size is known at compile time, so no branch is left
+  template <uint8_t Code> static PackedKey of(Op<Code> op) {
+    PackedKey key;
+    key.opcode = Code;
+    if constexpr (OPCODES[Code].size >= 9) {
+      key.operands = get_u64_le(op.instr.data() + 1);
+    } else if constexpr (OPCODES[Code].size >= 5) {
+      key.operands = uint32_t(get_i32_le(op.instr.data() + 1));
+    }
+    return key;
+  }
+
+  static PackedKey of(uint8_t opcode, int32_t arg0, int32_t arg1) {
+    return {uint64_t(uint32_t(arg0)) | uint64_t(uint32_t(arg1)) << 32, opcode};
+  }
+
+  // Writes the instruction bytes back into buf, which must hold at least 9 bytes
+  Instruction unpack(char *buf) const {
+    buf[0] = char(opcode);
+    for (int i = 0; i < 8; ++i) buf[1 + i] = char(operands >> 8 * i);
+    return Instruction(buf, OPCODES[opcode].size);
+  }
+
+  // STR operand, for opcodes that have one
+  bool     has_string() const noexcept { return OPCODES[opcode].operands == Operands::STR_INT; }
+  uint32_t string() const noexcept { return uint32_t(operands); }
+  void     set_string(uint32_t off) noexcept { operands = (operands & ~uint64_t(0xFFFFFFFF)) | off; }
+
+  size_t hash() const noexcept { return mix64(operands ^ (uint64_t(opcode) << 56 | opcode)); }
+
+  bool operator==(const PackedKey &rhs) const noexcept { return operands == rhs.operands && opcode == rhs.opcode; }
+};
+
+// Open addressing with linear probing over a flat array of slots,
+// so counting never allocates except on growth.
+// Key needs hash() and operator==; its default value is never mistaken for a slot, as count 0 marks empty ones
+template <typename Key> struct FlatCountTable {
+  struct ProbeStats {
+    size_t distinct    = 0;
+    size_t capacity    = 0;
+    size_t max_probe   = 0;
+    double mean_probe  = 0;
+    double load_factor = 0;
+  };
+
+  // Keeps the slots, so that refilling with about as many keys does not allocate
+  void clear() {
+    if (slots.empty()) {
+      slots.assign(INITIAL_CAPACITY, Slot{});
+    } else {
+      std::fill(slots.begin(), slots.end(), Slot{});
+    }
+    used = 0;
+  }
+
+  // A count of 0 would fill a slot that still reads as empty, so it adds nothing
+  void add(Key key, size_t n = 1) {
+    if (n == 0) return;
+    if (slots.empty()) clear();
+    size_t mask = slots.size() - 1;
+    for (size_t i = key.hash() & mask;; i = (i + 1) & mask) {
+      Slot &slot = slots[i];
+      if (slot.count == 0) {
+        slot = {key, n};
+        // Linear probing degrades quickly beyond half load
+        if (++used * 2 > slots.size()) grow();
+        return;
+      }
+      if (slot.key == key) {
+        slot.count += n;
+        return;
+      }
+    }
+  }
+
+  // Count of key, 0 if it has not been added
+  size_t count(Key key) const {
+    if (slots.empty()) return 0;
+    size_t mask = slots.size() - 1;
+    for (size_t i = key.hash() & mask;; i = (i + 1) & mask) {
+      const Slot &slot = slots[i];
+      if (slot.count == 0 || slot.key == key) return slot.count;
+    }
+  }
+
+  size_t size() const noexcept { return used; }
+
+  template <typename F> void for_each(F &&f) const {
+    for (const Slot &slot : slots)
+      if (slot.count != 0) f(slot.key, slot.count);
+  }
+
+  // Probe length of a key is the number of slots a successful lookup inspects
+  ProbeStats probe_stats() const {
+    ProbeStats st;
+    st.distinct = used;
+    st.capacity = slots.size();
+    if (slots.empty()) return st;
+
+    size_t mask  = slots.size() - 1;
+    size_t total = 0;
+    for (size_t i = 0; i < slots.size(); ++i) {
+      if (slots[i].count == 0) continue;
+      size_t home  = slots[i].key.hash() & mask;
+      size_t probe = ((i - home) & mask) + 1;
+      total += probe;
+      st.max_probe = std::max(st.max_probe, probe);
+    }
+    st.mean_probe  = used ? double(total) / used : 0;
+    st.load_factor = double(used) / slots.size();
+    return st;
+  }
+
+private:
+  struct Slot {
+    Key    key;
+    size_t count = 0; // 0 marks an empty slot
+  };
+
+  static constexpr size_t INITIAL_CAPACITY = 1024;
+
+  std::vector<Slot> slots;
+  size_t            used = 0;
+
+  void grow() {
+    std::vector<Slot> old = std::move(slots);
+    slots.assign(old.size() * 2, Slot{});
+    size_t mask = slots.size() - 1;
+    for (const Slot &slot : old) {
+      if (slot.count == 0) continue;
+      size_t i = slot.key.hash() & mask;
+      while (slots[i].count != 0) i = (i + 1) & mask;
+      slots[i] = slot;
+    }
+  }
+};
+
+using FlatFrequencyTable = FlatCountTable<PackedKey>;
+
+// Key of a variable-length instruction (CLOSURE) by its bytes, with the hash kept for growing tables
+struct InstrKey {
+  Instruction instr{nullptr, 0};
+  size_t      hash_value = 0;
+
+  static InstrKey of(const Instruction &instr) noexcept { return {instr, std::hash<Instruction>{}(instr)}; }
+
+  size_t hash() const noexcept { return hash_value; }
+
+  bool operator==(const InstrKey &rhs) const noexcept { return hash_value == rhs.hash_value && instr == rhs.instr; }
+};
+
+// Space-Saving (Metwally et al., "Efficient Computation of Frequent and Top-k Elements in Data Streams"):
+// at most `capacity` monitored keys, each with an upper bound of its count and by how much that may
+// overcount, so that count - error is a lower bound. A key that is not monitored occurred at most floor() times,
+// at most total() / capacity for a single stream. Summaries with the same capacity merge after Agarwal et al.,
+// "Mergeable Summaries", keeping every bound; keys must hash and compare alike in both
+template <typename Key> struct SpaceSaving {
+  struct Counter {
+    Key      key;
+    uint64_t count = 0;
+    uint64_t error = 0;
+  };
+
+  static constexpr size_t NONE = SIZE_MAX;
+
+  void reset(size_t capacity) {
+    limit = std::max<size_t>(1, capacity);
+    counters.clear();
+    counters.reserve(limit);
+    heap.clear();
+    heap_pos.clear();
+    size_t n_slots = 2;
+    while (n_slots < 2 * limit) n_slots *= 2;
+    index.assign(n_slots, EMPTY);
+    n_total = 0;
+    absent  = 0;
+  }
+
+  size_t   capacity() const noexcept { return limit; }
+  size_t   size() const noexcept { return counters.size(); }
+  uint64_t total() const noexcept { return n_total; }
+  uint64_t floor() const noexcept { return absent; }
+
+  const Counter &operator[](size_t i) const noexcept { return counters[i]; }
+
+  // For re-pointing a key at storage of the owner; it must keep hashing and comparing the same
+  Key &key(size_t i) noexcept { return counters[i].key; }
+
+  // Replaces every key by f(key), which may hash differently, e.g. after renumbering strings;
+  // the new keys must still be distinct
+  template <typename F> void rekey(F &&f) {
+    std::fill(index.begin(), index.end(), EMPTY);
+    for (uint32_t i = 0; i < counters.size(); ++i) {
+      counters[i].key = f(counters[i].key);
+      insert_slot(i);
+    }
+  }
+
+  // Counter of key, NONE if it is not monitored
+  size_t find(const Key &key) const noexcept {
+    size_t mask = index.size() - 1;
+    for (size_t s = key.hash() & mask;; s = (s + 1) & mask) {
+      if (index[s] == EMPTY) return NONE;
+      if (counters[index[s]].key == key) return index[s];
+    }
+  }
+
+  // Counts key n times and returns its counter, and whether the key was just admitted,
+  // in place of the least frequent one once all counters are taken
+  std::pair<size_t, bool> add(const Key &key, uint64_t n = 1) {
+    n_total += n;
+    size_t mask = index.size() - 1;
+    size_t s    = key.hash() & mask;
+    for (; index[s] != EMPTY; s = (s + 1) & mask) {
+      uint32_t i = index[s];
+      if (counters[i].key == key) {
+        counters[i].count += n;
+        sift_down(heap_pos[i]);
+        return {i, false};
+      }
+    }
+
+    if (counters.size() < limit) {
+      uint32_t i = uint32_t(counters.size());
+      counters.push_back({key, absent + n, absent});
+      index[s] = i;
+      heap.push_back(i);
+      heap_pos.push_back(uint32_t(heap.size() - 1));
+      sift_up(heap.size() - 1);
+      return {i, true};
+    }
+
+    uint32_t i   = heap[0];
+    uint64_t min = counters[i].count;
+    erase_slot(slot_of(i));
+    absent      = std::max(absent, min);
+    counters[i] = {key, min + n, min};
+    insert_slot(i);
+    sift_down(0);
+    return {i, true};
+  }
+
+  void merge(const SpaceSaving &other) {
+    std::vector<Counter> all;
+    all.reserve(size() + other.size());
+    for (const Counter &c : counters) {
+      size_t j = other.find(c.key);
+      if (j != NONE) {
+        all.push_back({c.key, c.count + other.counters[j].count, c.error + other.counters[j].error});
+      } else {
+        all.push_back({c.key, c.count + other.absent, c.error + other.absent});
+      }
+    }
+    for (const Counter &c : other.counters)
+      if (find(c.key) == NONE) all.push_back({c.key, c.count + absent, c.error + absent});
+
+    uint64_t merged_absent = absent + other.absent;
+    if (all.size() > limit) {
+      auto by_count = [](const Counter &a, const Counter &b) { return a.count > b.count; };
+      std::nth_element(all.begin(), all.begin() + limit, all.end(), by_count);
+      for (auto it = all.begin() + limit; it != all.end(); ++it) merged_absent = std::max(merged_absent, it->count);
+      all.resize(limit);
+    }
+
+    uint64_t merged_total = n_total + other.n_total;
+    reset(limit);
+    n_total  = merged_total;
+    absent   = merged_absent;
+    counters = std::move(all);
+    for (uint32_t i = 0; i < counters.size(); ++i) {
+      insert_slot(i);
+      heap.push_back(i);
+      heap_pos.push_back(i);
+    }
+    for (size_t h = heap.size() / 2; h-- > 0;) sift_down(h);
+  }
+
+private:
+  static constexpr uint32_t EMPTY = UINT32_MAX;
+
+  std::vector<Counter>  counters;
+  std::vector<uint32_t> heap;     // counters, least count first
+  std::vector<uint32_t> heap_pos; // of each counter in heap
+  std::vector<uint32_t> index;    // counters by key, linear probing at most half full
+  size_t                limit   = 1;
+  uint64_t              n_total = 0;
+  uint64_t              absent  = 0;
+
+  size_t slot_of(uint32_t i) const noexcept {
+    size_t mask = index.size() - 1;
+    size_t s    = counters[i].key.hash() & mask;
+    while (index[s] != i) s = (s + 1) & mask;
+    return s;
+  }
+
+  void insert_slot(uint32_t i) noexcept {
+    size_t mask = index.size() - 1;
+    size_t s    = counters[i].key.hash() & mask;
+    while (index[s] != EMPTY) s = (s + 1) & mask;
+    index[s] = i;
+  }
+
+  // Backward-shift deletion: later keys of the probe run move up, so that no tombstones are needed
+  void erase_slot(size_t s) noexcept {
+    size_t mask = index.size() - 1;
+    for (size_t next = (s + 1) & mask; index[next] != EMPTY; next = (next + 1) & mask) {
+      size_t home = counters[index[next]].key.hash() & mask;
+      if (((next - home) & mask) >= ((next - s) & mask)) {
+        index[s] = index[next];
+        s        = next;
+      }
+    }
+    index[s] = EMPTY;
+  }
+
+  void swap_heap(size_t a, size_t b) noexcept {
+    std::swap(heap[a], heap[b]);
+    heap_pos[heap[a]] = uint32_t(a);
+    heap_pos[heap[b]] = uint32_t(b);
+  }
+
+  void sift_up(size_t h) noexcept {
+    for (; h > 0 && counters[heap[h]].count < counters[heap[(h - 1) / 2]].count; h = (h - 1) / 2)
+      swap_heap(h, (h - 1) / 2);
+  }
+
+  void sift_down(size_t h) noexcept {
+    for (;;) {
+      size_t least = h, l = 2 * h + 1, r = l + 1;
+      if (l < heap.size() && counters[heap[l]].count < counters[heap[least]].count) least = l;
+      if (r < heap.size() && counters[heap[r]].count < counters[heap[least]].count) least = r;
+      if (least == h) return;
+      swap_heap(h, least);
+      h = least;
+    }
+  }
+};
+
+// Stable storage for instruction bytes that must outlive their bytecode file.
+// Clearing keeps the blocks, so that an arena refilled file after file stops allocating
+struct ByteArena {
+  // Uninitialized storage; align must be a power of two not above alignof(std::max_align_t)
+  char *allocate(size_t n, size_t align = 1) {
+    size_t pad = -uintptr_t(cur) & (align - 1);
+    if (n + pad > left) {
+      next_block(n);
+      pad = 0;
+    }
+    char *res = cur + pad;
+    cur       = res + n;
+    left -= n + pad;
+    return res;
+  }
+
+  const char *copy(const char *bytes, size_t n) {
+    char *res = allocate(n);
+    std::memcpy(res, bytes, n);
+    return res;
+  }
+
+  void clear() noexcept {
+    n_used = 0;
+    cur    = nullptr;
+    left   = 0;
+  }
+
+private:
+  static constexpr size_t DEFAULT_BLOCK = 1 << 16;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t                  size;
+  };
+
+  std::vector<Block> blocks;
+  size_t             n_used = 0; // blocks handed out since the last clear
+  char              *cur    = nullptr;
+  size_t             left   = 0;
+
+  // Moves on to the first unused block that holds n bytes, or a new one
+  void next_block(size_t n) {
+    while (n_used < blocks.size() && blocks[n_used].size < n) ++n_used;
+    if (n_used == blocks.size()) {
+      size_t size = std::max(n, DEFAULT_BLOCK);
+      blocks.push_back({std::make_unique<char[]>(size), size});
+    }
+    cur  = blocks[n_used].data.get();
+    left = blocks[n_used].size;
+    n_used++;
+  }
+};
+
+// Owned, de-duplicated NUL-terminated strings, laid out like a bytecode string table.
+// Offsets never change once handed out, so tables of several files can share one pool
+// and compare their STR operands as plain integers; interning is safe from several threads,
+// views only once no thread interns any more
+struct StringPool {
+  uint32_t intern(std::string_view str) {
+    std::lock_guard lock(mutex);
+    if (auto it = index.find(str); it != index.end()) return it->second;
+
+    uint32_t off = uint32_t(data.size());
+    data.insert(data.end(), str.begin(), str.end());
+    data.push_back(0);
+    for (size_t len = str.size() + 1; len-- > 0;) lengths.push_back(uint32_t(len));
+    index.emplace(std::string_view(arena.copy(str.data(), str.size()), str.size()), off);
+    return off;
+  }
+
+  void clear() {
+    data.clear();
+    lengths.clear();
+    index.clear();
+    arena.clear();
+  }
+
+  bool        empty() const noexcept { return data.empty(); }
+  StringTable view() const noexcept { return {data.data(), data.size(), lengths.data(), nullptr}; }
+
+private:
+  std::vector<char>                              data;
+  std::vector<uint32_t>                          lengths;
+  std::unordered_map<std::string_view, uint32_t> index; // views into arena, which does not move
+  ByteArena                                      arena;
+  std::mutex                                     mutex;
+};
+
+enum class Format { TEXT, CSV, JSONL, BIN };
+
+// How much of an instruction tells rows apart, as a bit set:
+//   exact  - every operand byte, e.g. "LD L(3)"
+//   kind   - the opcode, which includes the operand kind, e.g. "LD L(*)"
+//   opcode - the mnemonic alone, e.g. "LD"
+enum Level : uint8_t { LEVEL_EXACT = 1, LEVEL_KIND = 2, LEVEL_OPCODE = 4 };
+
+constexpr const char *level_name(Level level) {
+  switch (level) {
+  case LEVEL_EXACT: return "exact";
+  case LEVEL_KIND: return "kind";
+  case LEVEL_OPCODE: return "opcode";
+  }
+  return "";
+}
+
+struct ReportOptions {
+  size_t      top        = SIZE_MAX; // rows to print, per level
+  size_t      min_count  = 1;        // rows with fewer occurrences are skipped before sorting
+  Format      format     = Format::TEXT;
+  uint8_t     levels     = LEVEL_EXACT;
+  const char *function   = nullptr; // leading column of CSV and JSONL rows, for per-function reports
+  bool        csv_header = true;
+};
+
+// First word of the mnemonic, e.g. "CALL" for both "CALL\t0x" and "CALL\tLread"
+constexpr std::string_view bare_mnemonic(uint8_t opcode) {
+  std::string_view mnemonic = OPCODES[opcode].mnemonic;
+  return mnemonic.substr(0, mnemonic.find_first_of(" \t"));
+}
+
+// Binary profile, all integers little-endian:
+//   magic "BCFREQ01"
+//   u32 size of the string section, then the section itself: de-duplicated NUL-terminated strings
+//   u64 number of rows, then for each row:
+//     u32 instruction size, raw instruction bytes, u64 count
+// STR operands of the instructions are offsets into the string section
+constexpr std::string_view PROFILE_MAGIC = "BCFREQ01";
+
+inline bool is_profile(const char *data, size_t size) {
+  return size >= PROFILE_MAGIC.size() && std::string_view(data, PROFILE_MAGIC.size()) == PROFILE_MAGIC;
+}
+
+// Backing bytes for instructions unpacked from packed keys
+using KeyStorage = std::vector<std::array<char, 9>>;
+
+// Counts either refer to a single bytecode file (after parse)
+// or own their keys and strings (after merge), so they can outlive the files they came from
+struct Frequencies {
+  void parse(const DecodedProgram &prog) {
+    ScopedPhase phase(PHASE_COUNT);
+    clear();
+    file_strings = prog.source().strings();
+    phase.add_work(prog.offsets[prog.size()], prog.size());
+
+    for (size_t i = 0; i < prog.size(); ++i) {
+      uint8_t opcode = prog.opcodes[i];
+      opcode_counts[opcode]++;
+      if (opcode == OP_CLOSURE) {
+        closures.add(InstrKey::of(prog.instr(i)));
+      } else {
+        table.add(canonical(PackedKey::of(opcode, prog.arg0[i], prog.arg1[i])));
+      }
+    }
+  }
+
+  // Counts instruction i of prog counts[i] times, e.g. from an execution profile
+  void parse(const DecodedProgram &prog, const std::vector<uint64_t> &counts) {
+    ScopedPhase phase(PHASE_COUNT);
+    clear();
+    file_strings = prog.source().strings();
+    phase.add_work(prog.offsets[prog.size()], prog.size());
+
+    for (size_t i = 0; i < prog.size(); ++i) {
+      uint8_t opcode = prog.opcodes[i];
+      size_t  n      = counts[i];
+      if (n == 0) continue;
+      opcode_counts[opcode] += n;
+      if (opcode == OP_CLOSURE) {
+        closures.add(InstrKey::of(prog.instr(i)), n);
+      } else {
+        table.add(canonical(PackedKey::of(opcode, prog.arg0[i], prog.arg1[i])), n);
+      }
+    }
+  }
+
+  void add(const Instruction &instr, size_t n = 1) {
+    opcode_counts[instr.opcode()] += n;
+    if (instr.opcode() == OP_CLOSURE) {
+      closures.add(InstrKey::of(instr), n);
+    } else {
+      table.add(canonical(PackedKey::of(instr)), n);
+    }
+  }
+
+  // Same as add, for an instruction handed to a visitor (see decode); the operands are in the key already
+  template <uint8_t Code, typename... Args> void add(Op<Code> op, const Args &...) {
+    opcode_counts[Code]++;
+    if constexpr (Code == OP_CLOSURE) {
+      closures.add(InstrKey::of(op.instr));
+    } else {
+      table.add(canonical(PackedKey::of(op)));
+    }
+  }
+
+  // Counts a stream chunk by chunk; CLOSURE keys are copied, as the chunks are reused
+  void parse(BytecodeStream &stream) {
+    ScopedPhase phase(PHASE_COUNT);
+    clear();
+    file_strings = stream.strings();
+    stream.for_each_instr([&](const Instruction &instr) {
+      add_transient(instr);
+      phase.add_work(instr.size(), 1);
+    });
+  }
+
+  // Counts the instructions in [begin, end) of the code section straight from the bytes.
+  // The range must have been validated (see chunk_boundaries), so that the loop has no checks;
+  // begin must be an instruction boundary, and the last instruction may extend past end
+  void parse(const BytecodeFile &src, size_t begin, size_t end) {
+    ScopedPhase phase(PHASE_COUNT);
+    clear();
+    file_strings = src.strings();
+
+    size_t n_instrs = 0;
+    decode_unchecked(src, begin, end, [&](auto op, const auto &...operands) {
+      add(op, operands...);
+      n_instrs++;
+    });
+    phase.add_work(end - begin, n_instrs);
+  }
+
+  // Same as add, for instructions whose bytes do not outlive the call
+  void add_transient(const Instruction &instr, size_t n = 1) {
+    opcode_counts[instr.opcode()] += n;
+    if (instr.opcode() == OP_CLOSURE) {
+      add_closure_copy(InstrKey::of(instr), n);
+    } else {
+      table.add(canonical(PackedKey::of(instr)), n);
+    }
+  }
+
+  // Adds the counts of a table parsed from the same bytecode file
+  void add_counts(const Frequencies &other) {
+    ScopedPhase phase(PHASE_MERGE);
+    if (owned || other.owned) throw std::logic_error("Adding counts of owned frequency tables");
+    if (distinct() == 0) file_strings = other.file_strings;
+    other.table.for_each([&](PackedKey key, size_t n) { table.add(key, n); });
+    other.closures.for_each([&](InstrKey key, size_t n) { closures.add(key, n); });
+    add_opcode_counts(other);
+  }
+
+  // Interns the strings of later merges into a pool that other tables may share,
+  // so that merging tables of the same pool skips the strings altogether. Only for empty tables
+  void share_strings(std::shared_ptr<StringPool> shared) {
+    if (distinct() != 0) throw std::logic_error("Sharing the strings of a filled frequency table");
+    pool = std::move(shared);
+  }
+
+  // Adds the counts of another table, copying each of its distinct keys once.
+  // Afterwards this table owns all of its keys; it must not have been filled by parse
+  void merge(const Frequencies &other) {
+    ScopedPhase phase(PHASE_MERGE);
+    if (!owned && distinct() != 0) throw std::logic_error("Merging into a file-backed frequency table");
+    own();
+
+    if (other.owned && other.pool == pool) {
+      other.table.for_each([&](PackedKey key, size_t n) { table.add(key, n); });
+    } else {
+      StringTable other_strings = other.strings();
+      other.table.for_each([&](PackedKey key, size_t n) {
+        if (key.has_string()) key.set_string(pool->intern(other_strings.get_view(key.string())));
+        table.add(key, n);
+      });
+    }
+
+    other.closures.for_each([&](InstrKey key, size_t n) { add_closure_copy(key, n); });
+    add_opcode_counts(other);
+  }
+
+  // Adds the counts of a binary profile, see PROFILE_MAGIC
+  void merge_binary(const char *data, size_t size) {
+    ScopedPhase phase(PHASE_MERGE);
+    phase.add_work(size, 0);
+    if (!owned && distinct() != 0) throw std::logic_error("Merging into a file-backed frequency table");
+
+    auto need = [&](size_t off, size_t n) {
+      if (off + n > size) throw std::runtime_error("Truncated profile");
+    };
+    if (!is_profile(data, size)) throw std::runtime_error("Not a profile");
+    size_t pos = PROFILE_MAGIC.size();
+    need(pos, 4);
+    StringTable profile_strings{data + pos + 4, uint32_t(get_i32_le(data + pos))};
+    pos += 4 + profile_strings.size;
+    need(pos, 8);
+    if (profile_strings.size != 0 && profile_strings.data[profile_strings.size - 1] != 0)
+      throw std::runtime_error("Last string in profile is not null-terminated");
+    uint64_t n_rows = get_u64_le(data + pos);
+    size_t   first  = pos + 8;
+
+    // Every row is checked before any is merged, so that a damaged profile adds nothing
+    auto for_each_row = [&](auto &&f) {
+      size_t at = first;
+      for (uint64_t row = 0; row < n_rows; ++row) {
+        need(at, 4);
+        uint32_t len = get_i32_le(data + at);
+        at += 4;
+        need(at, size_t(len) + 8);
+        const char *bytes = data + at;
+        if (len == 0 || Instruction::validate(bytes, len, profile_strings.size) != len)
+          throw std::runtime_error("Invalid instruction in profile");
+        size_t n = get_u64_le(bytes + len);
+        if (n == 0) throw std::runtime_error("Row without occurrences in profile");
+        at += len + 8;
+        f(Instruction(bytes, len), n);
+      }
+      if (at != size) throw std::runtime_error("Trailing bytes after profile");
+    };
+    for_each_row([](const Instruction &, size_t) {});
+
+    own();
+    for_each_row([&](const Instruction &instr, size_t n) {
+      if (instr.opcode() == OP_CLOSURE) return add_transient(instr, n);
+      PackedKey key = PackedKey::of(instr);
+      if (key.has_string()) key.set_string(pool->intern(profile_strings.get_view(key.string())));
+      opcode_counts[key.opcode] += n;
+      table.add(key, n);
+    });
+  }
+
+  // Renumbers owned strings in lexicographic order, so that merged output
+  // does not depend on the order in which tables were merged
+  // Takes a pool of its own, holding only the strings of this table
+  void canonicalize() {
+    ScopedPhase phase(PHASE_MERGE);
+    if (!owned || pool->empty()) return;
+
+    StringTable                   old_view = pool->view();
+    std::vector<std::string_view> sorted;
+    table.for_each([&](PackedKey key, size_t) {
+      if (key.has_string()) sorted.push_back(old_view.get_view(key.string()));
+    });
+    std::sort(sorted.begin(), sorted.end());
+    auto new_pool = std::make_shared<StringPool>();
+    for (std::string_view str : sorted) new_pool->intern(str);
+
+    FlatFrequencyTable new_table;
+    table.for_each([&](PackedKey key, size_t n) {
+      if (key.has_string()) key.set_string(new_pool->intern(old_view.get_view(key.string())));
+      new_table.add(key, n);
+    });
+    table = std::move(new_table);
+    pool  = std::move(new_pool);
+  }
+
+  void clear() {
+    table.clear();
+    closures.clear();
+    pool.reset();
+    arena.clear();
+    opcode_counts.fill(0);
+    file_strings = {};
+    owned        = false;
+  }
+
+  size_t distinct() const noexcept { return table.size() + closures.size(); }
+
+  // Every distinct key with its count, the packed ones first, then those of CLOSURE.
+  // Owned tables sharing a pool give an instruction the same key, so they can be looked up in one another
+  template <typename F> void for_each_key(F &&f) const {
+    table.for_each(f);
+    closures.for_each(f);
+  }
+
+  size_t count(PackedKey key) const { return table.count(key); }
+  size_t count(InstrKey key) const { return closures.count(key); }
+  size_t opcode_count(uint8_t opcode) const noexcept { return opcode_counts[opcode]; }
+
+  // Where the STR operands of the rows of top point to
+  StringTable strings() const noexcept { return owned ? pool->view() : file_strings; }
+
+  // The most frequent instructions first, ties broken by Instruction::operator<.
+  // The rows and the bytes of their keys stay in buffers of the table until the next call
+  const std::vector<std::pair<Instruction, size_t>> &top(const ReportOptions &report) const {
+    ScopedPhase phase(PHASE_SORT);
+    std::vector<std::pair<Instruction, size_t>> &rows = top_rows;
+    rows.clear();
+    key_bytes.clear();
+    key_bytes.reserve(table.size());
+    table.for_each([&](PackedKey key, size_t n) {
+      if (n < report.min_count) return;
+      rows.emplace_back(key.unpack(key_bytes.emplace_back().data()), n);
+    });
+    closures.for_each([&](InstrKey key, size_t n) {
+      if (n >= report.min_count) rows.emplace_back(key.instr, n);
+    });
+
+    auto by_frequency = [](auto &&a, auto &&b) {
+      if (a.second != b.second) return a.second > b.second;
+      return a.first < b.first;
+    };
+    // Selecting first keeps the sort to the rows actually printed
+    if (report.top < rows.size()) {
+      std::nth_element(rows.begin(), rows.begin() + report.top, rows.end(), by_frequency);
+      rows.erase(rows.begin() + report.top, rows.end());
+    }
+    std::sort(rows.begin(), rows.end(), by_frequency);
+    return rows;
+  }
+
+  void print(std::ostream &os, const ReportOptions &report = {}) const {
+    ScopedPhase  phase(PHASE_OUTPUT);
+    OutputBuffer out(os);
+    if (report.format == Format::BIN) {
+      if (report.levels != LEVEL_EXACT) throw std::invalid_argument("Binary profiles hold exact instructions only");
+      write_binary(out, top(report));
+      return;
+    }
+
+    // Several levels are told apart by a heading, or by a leading column
+    bool labelled = (report.levels & (report.levels - 1)) != 0;
+    if (report.format == Format::CSV && report.csv_header) {
+      if (report.function) out.write("function,");
+      out.write(labelled ? "level,count,opcode,bytes,instruction\n" : "count,opcode,bytes,instruction\n");
+    }
+    bool first = true;
+    for (Level level : {LEVEL_EXACT, LEVEL_KIND, LEVEL_OPCODE}) {
+      if (!(report.levels & level)) continue;
+      const char *label = labelled ? level_name(level) : nullptr;
+      if (label && report.format == Format::TEXT) {
+        if (!first) out.put('\n');
+        out.write("# ");
+        out.write(label);
+        out.put('\n');
+      }
+      first = false;
+      if (level == LEVEL_EXACT) {
+        print_exact(out, report, label);
+      } else {
+        print_aggregated(out, report, level, label);
+      }
+    }
+  }
+
+  void print_stats(std::ostream &os) const {
+    FlatFrequencyTable::ProbeStats st = table.probe_stats();
+    os << "distinct instructions: " << distinct() << '\n';
+    os << "flat table: " << st.distinct << " keys in " << st.capacity << " slots, load factor " << st.load_factor
+       << '\n';
+    os << "probe length: mean " << st.mean_probe << ", max " << st.max_probe << '\n';
+    os << "CLOSURE side table: " << closures.size() << " keys\n";
+  }
+
+private:
+  FlatFrequencyTable                      table;
+  FlatCountTable<InstrKey>                closures; // variable-length, so kept apart from the packed keys
+  std::array<size_t, 256>                 opcode_counts = {}; // the same counts by opcode, for the coarser levels
+
+  // Where STR operands point to: the bytecode file, or the pool once owned
+  StringTable                 file_strings;
+  std::shared_ptr<StringPool> pool;
+  ByteArena                   arena; // bytes of owned CLOSURE keys
+  bool                        owned = false;
+
+  // Sort buffers of top, reused from print to print
+  mutable std::vector<std::pair<Instruction, size_t>> top_rows;
+  mutable KeyStorage                                  key_bytes;
+
+  void own() {
+    if (!pool) pool = std::make_shared<StringPool>();
+    owned = true;
+  }
+
+  // Equal strings at different offsets of a file share one row
+  PackedKey canonical(PackedKey key) const noexcept {
+    if (key.has_string()) key.set_string(file_strings.canonical_of(key.string()));
+    return key;
+  }
+
+  // Function and level columns, for the rows that carry them
+  static void write_label(OutputBuffer &out, const ReportOptions &report, const char *label) {
+    if (report.format == Format::CSV) {
+      if (report.function) {
+        out.write_csv_quoted(report.function);
+        out.put(',');
+      }
+      if (label) {
+        out.write(label);
+        out.put(',');
+      }
+    } else if (report.format == Format::JSONL) {
+      if (report.function) {
+        out.write("\"function\":\"");
+        out.write_json_escaped(report.function);
+        out.write("\",");
+      }
+      if (label) {
+        out.write("\"level\":\"");
+        out.write(label);
+        out.write("\",");
+      }
+    }
+  }
+
+  void print_exact(OutputBuffer &out, const ReportOptions &report, const char *label) const {
+    StringTable str  = strings();
+    const auto &rows = top(report);
+
+    std::string  text;
+    OutputBuffer text_out(text);
+    for (auto [code, n_entries] : rows) {
+      switch (report.format) {
+      case Format::TEXT:
+        out.write_uint(n_entries);
+        out.write(" x ");
+        code.print(str, out);
+        out.put('\n');
+        break;
+
+      case Format::CSV:
+      case Format::JSONL:
+        text.clear();
+        code.print(str, text_out);
+        text_out.flush();
+        if (report.format == Format::CSV) {
+          write_label(out, report, label);
+          out.write_uint(n_entries);
+          out.put(',');
+          out.write_uint(code.opcode());
+          out.put(',');
+          out.write_hex_bytes(code.data(), code.size());
+          out.put(',');
+          out.write_csv_quoted(text);
+        } else {
+          out.put('{');
+          write_label(out, report, label);
+          out.write("\"count\":");
+          out.write_uint(n_entries);
+          out.write(",\"opcode\":");
+          out.write_uint(code.opcode());
+          out.write(",\"bytes\":\"");
+          out.write_hex_bytes(code.data(), code.size());
+          out.write("\",\"instruction\":\"");
+          out.write_json_escaped(text);
+          out.write("\"}");
+        }
+        out.put('\n');
+        break;
+
+      case Format::BIN: break;
+      }
+    }
+  }
+
+  // Rows of the kind level are opcodes; those of the opcode level are mnemonics,
+  // reported under their lowest opcode
+  void print_aggregated(OutputBuffer &out, const ReportOptions &report, Level level, const char *label) const {
+    struct Row {
+      uint8_t opcode;
+      size_t  count;
+    };
+    std::vector<Row> rows;
+    for (size_t op = 0; op < 256; ++op) {
+      size_t n = opcode_counts[op];
+      if (n == 0) continue;
+      if (level == LEVEL_OPCODE) {
+        auto same = [&](const Row &row) { return bare_mnemonic(row.opcode) == bare_mnemonic(uint8_t(op)); };
+        auto it   = std::find_if(rows.begin(), rows.end(), same);
+        if (it != rows.end()) {
+          it->count += n;
+          continue;
+        }
+      }
+      rows.push_back({uint8_t(op), n});
+    }
+    rows.erase(std::remove_if(rows.begin(), rows.end(), [&](const Row &row) { return row.count < report.min_count; }),
+               rows.end());
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+      if (a.count != b.count) return a.count > b.count;
+      return a.opcode < b.opcode;
+    });
+    if (report.top < rows.size()) rows.erase(rows.begin() + report.top, rows.end());
+
+    std::string  text;
+    OutputBuffer text_out(text);
+    for (const Row &row : rows) {
+      text.clear();
+      if (level == LEVEL_KIND) {
+        Instruction::print_shape(row.opcode, text_out);
+      } else {
+        text_out.write(bare_mnemonic(row.opcode));
+      }
+      text_out.flush();
+
+      switch (report.format) {
+      case Format::TEXT:
+        out.write_uint(row.count);
+        out.write(" x ");
+        out.write(text);
+        break;
+
+      case Format::CSV:
+        write_label(out, report, label);
+        out.write_uint(row.count);
+        out.put(',');
+        if (level == LEVEL_KIND) {
+          char byte = char(row.opcode);
+          out.write_uint(row.opcode);
+          out.put(',');
+          out.write_hex_bytes(&byte, 1);
+        } else {
+          out.put(',');
+        }
+        out.put(',');
+        out.write_csv_quoted(text);
+        break;
+
+      case Format::JSONL:
+        out.put('{');
+        write_label(out, report, label);
+        out.write("\"count\":");
+        out.write_uint(row.count);
+        if (level == LEVEL_KIND) {
+          out.write(",\"opcode\":");
+          out.write_uint(row.opcode);
+        }
+        out.write(",\"instruction\":\"");
+        out.write_json_escaped(text);
+        out.write("\"}");
+        break;
+
+      case Format::BIN: break;
+      }
+      out.put('\n');
+    }
+  }
+
+  void add_opcode_counts(const Frequencies &other) {
+    for (size_t op = 0; op < 256; ++op) opcode_counts[op] += other.opcode_counts[op];
+  }
+
+  // Counts a CLOSURE key, copying its bytes the first time it is seen
+  void add_closure_copy(InstrKey key, size_t n) {
+    if (closures.count(key) == 0) {
+      key.instr = Instruction(arena.copy(key.instr.data(), key.instr.size()), key.instr.size());
+    }
+    closures.add(key, n);
+  }
+
+  // Strings referenced by the rows are re-interned, so that the
+  // string section holds only those, each once
+  void write_binary(OutputBuffer &out, const std::vector<std::pair<Instruction, size_t>> &rows) const {
+    StringTable           str = strings();
+    StringPool            section;
+    std::vector<uint32_t> offsets(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+      const Instruction &instr = rows[i].first;
+      if (OPCODES[instr.opcode()].operands == Operands::STR_INT)
+        offsets[i] = section.intern(str.get_view(get_i32_le(instr.data() + 1)));
+    }
+
+    StringTable section_view = section.view();
+    out.write(PROFILE_MAGIC);
+    out.write_le(section_view.size, 4);
+    out.write({section_view.data, section_view.size});
+    out.write_le(rows.size(), 8);
+    for (size_t i = 0; i < rows.size(); ++i) {
+      const Instruction &instr = rows[i].first;
+      out.write_le(instr.size(), 4);
+      if (OPCODES[instr.opcode()].operands == Operands::STR_INT) {
+        out.put(instr.data()[0]);
+        out.write_le(offsets[i], 4);
+        out.write({instr.data() + 5, instr.size() - 5});
+      } else {
+        out.write({instr.data(), instr.size()});
+      }
+      out.write_le(rows[i].second, 8);
+    }
+  }
+};
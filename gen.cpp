@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// #####################################################################
+// ##                  Synthetic bytecode generator                   ##
+// #####################################################################
+// Emits valid bytecode for benchmarking: a sequence of functions,
+// each BEGIN ... END, with jumps landing on instruction boundaries of the same function,
+// calls and closures targeting function entries and STR operands pointing into the string table.
+//
+// Mixes:
+//   realistic  - opcode frequencies and operand ranges resembling compiled Lama code
+//   repetitive - the same opcode mix with operands drawn from tiny sets, few distinct rows
+//   distinct   - the same opcode mix with operands spread over the whole range
+
+enum class Mix { REALISTIC, REPETITIVE, DISTINCT };
+
+struct Options {
+  size_t      size_mb   = 16;
+  Mix         mix       = Mix::REALISTIC;
+  uint32_t    seed      = 1;
+  size_t      n_strings = 256;
+  const char *output    = nullptr;
+
+  bool parse(int argc, const char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+      std::string_view arg = argv[i];
+      if (i + 1 == argc) return false;
+      if (arg == "--size") {
+        size_mb = std::strtoull(argv[++i], nullptr, 10);
+      } else if (arg == "--seed") {
+        seed = std::strtoul(argv[++i], nullptr, 10);
+      } else if (arg == "--strings") {
+        n_strings = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+      } else if (arg == "-o") {
+        output = argv[++i];
+      } else if (arg == "--mix") {
+        std::string_view mix_name = argv[++i];
+        if (mix_name == "realistic") {
+          mix = Mix::REALISTIC;
+        } else if (mix_name == "repetitive") {
+          mix = Mix::REPETITIVE;
+        } else if (mix_name == "distinct") {
+          mix = Mix::DISTINCT;
+        } else {
+          return false;
+        }
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+struct Generator {
+  explicit Generator(const Options &opts) : opts(opts), rng(opts.seed) {
+    for (size_t i = 0; i < opts.n_strings; ++i) {
+      string_offsets.push_back(strings.size());
+      std::string name = "Tag" + std::to_string(i);
+      strings.insert(strings.end(), name.begin(), name.end());
+      strings.push_back(0);
+    }
+  }
+
+  void run(std::ostream &os) {
+    size_t target = opts.size_mb << 20;
+    while (code.size() < target) function();
+    code.push_back(char(0xFF));
+
+    // Every function entry up to a handful is exported, main first
+    std::vector<char> symbols;
+    for (size_t i = 0; i < std::min<size_t>(entries.size(), 16); ++i) {
+      put_i32(symbols, string_offsets[i % string_offsets.size()]);
+      put_i32(symbols, entries[i]);
+    }
+
+    std::vector<char> header;
+    put_i32(header, strings.size());
+    put_i32(header, 1);
+    put_i32(header, symbols.size() / 8);
+    os.write(header.data(), header.size());
+    os.write(symbols.data(), symbols.size());
+    os.write(strings.data(), strings.size());
+    os.write(code.data(), code.size());
+  }
+
+private:
+  // A forward or backward branch whose target is patched once the function body is known
+  struct Fixup {
+    size_t operand_pos;
+    size_t target_instr;
+  };
+
+  const Options    &opts;
+  std::mt19937      rng;
+  std::vector<char> strings;
+  std::vector<char> code;
+
+  std::vector<uint32_t> string_offsets;
+  std::vector<uint32_t> entries; // code offsets of function entries
+  uint32_t              line = 1;
+
+  static void put_i32(std::vector<char> &out, int32_t x) {
+    for (int i = 0; i < 4; ++i) out.push_back(char(uint32_t(x) >> 8 * i));
+  }
+
+  void put_i32_at(size_t pos, int32_t x) {
+    for (int i = 0; i < 4; ++i) code[pos + i] = char(uint32_t(x) >> 8 * i);
+  }
+
+  size_t uniform(size_t n) { return std::uniform_int_distribution<size_t>(0, n - 1)(rng); }
+
+  // Small operands for realistic and repetitive mixes, anything for distinct
+  int32_t operand(int32_t realistic_range) {
+    switch (opts.mix) {
+    case Mix::REALISTIC: {
+      // Skewed towards small values, like local slots and constants in real code
+      std::geometric_distribution<int32_t> dist(0.3);
+      return std::min(dist(rng), realistic_range - 1);
+    }
+    case Mix::REPETITIVE: return int32_t(uniform(2));
+    case Mix::DISTINCT: return int32_t(rng());
+    }
+    return 0;
+  }
+
+  uint32_t string_operand() {
+    size_t n = opts.mix == Mix::REPETITIVE ? std::min<size_t>(2, string_offsets.size()) : string_offsets.size();
+    return string_offsets[uniform(n)];
+  }
+
+  uint32_t entry_operand() { return entries.empty() ? 0 : entries[uniform(entries.size())]; }
+
+  void op(uint8_t opcode) { code.push_back(char(opcode)); }
+
+  void op(uint8_t opcode, int32_t a) {
+    op(opcode);
+    put_i32(code, a);
+  }
+
+  void op(uint8_t opcode, int32_t a, int32_t b) {
+    op(opcode, a);
+    put_i32(code, b);
+  }
+
+  void function() {
+    entries.push_back(code.size());
+    op(entries.size() % 4 == 0 ? 0x53 : 0x52, operand(4), operand(8));
+
+    std::vector<uint32_t> instr_offsets;
+    std::vector<Fixup>    fixups;
+    size_t                n_instrs = 20 + uniform(200);
+    for (size_t i = 0; i < n_instrs; ++i) {
+      instr_offsets.push_back(code.size());
+      body_instruction(fixups, n_instrs);
+    }
+    instr_offsets.push_back(code.size());
+    op(0x16); // END
+
+    for (const Fixup &fix : fixups) put_i32_at(fix.operand_pos, instr_offsets[fix.target_instr]);
+  }
+
+  void body_instruction(std::vector<Fixup> &fixups, size_t n_instrs) {
+    // Cumulative weights per mille, roughly the static mix of compiled Lama programs
+    size_t r = uniform(1000);
+    if (r < 120) return op(0x18); // DROP
+    if (r < 230) return op(0x19); // DUP
+    if (r < 300) return op(0x1B); // ELEM
+    if (r < 400) return op(0x10, operand(100)); // CONST
+    if (r < 520) return op(0x20 + uniform(4), operand(16)); // LD
+    if (r < 560) return op(0x30 + uniform(4), operand(16)); // LDA
+    if (r < 620) return op(0x40 + uniform(4), operand(16)); // ST
+    if (r < 700) return op(0x01 + uniform(13)); // BINOP
+    if (r < 760) {
+      // LINE numbers grow through the module, which is where most distinct rows come from
+      line += 1 + uniform(3);
+      return op(0x5A, opts.mix == Mix::REPETITIVE ? int32_t(line % 2) : int32_t(line));
+    }
+    if (r < 790) return op(0x12, string_operand(), operand(5)); // SEXP
+    if (r < 810) return op(0x57, string_operand(), operand(5)); // TAG
+    if (r < 820) return op(0x11, string_operand()); // STRING
+    if (r < 850) {
+      static constexpr uint8_t JUMPS[] = {0x15, 0x50, 0x51}; // JMP, CJMPz, CJMPnz
+      op(JUMPS[uniform(3)]);
+      fixups.push_back({code.size(), uniform(n_instrs + 1)});
+      return put_i32(code, 0);
+    }
+    if (r < 890) return op(0x56, entry_operand(), operand(4)); // CALL
+    if (r < 900) return op(0x55, operand(4)); // CALLC
+    if (r < 915) return closure();
+    if (r < 930) return op(0x60 + uniform(7)); // PATT
+    if (r < 950) return op(0x70 + uniform(4)); // CALL Lread ... Lstring
+    if (r < 960) return op(0x74, operand(8)); // CALL Barray
+    if (r < 970) return op(0x58, operand(8)); // ARRAY
+    if (r < 975) return op(0x59, int32_t(line), operand(40)); // FAIL
+    if (r < 985) return op(0x13 + uniform(2)); // STI, STA
+    if (r < 995) return op(0x1A); // SWAP
+    return op(0x17); // RET
+  }
+
+  void closure() {
+    // Mostly a few captures, now and then a long one
+    int32_t n = uniform(20) == 0 ? int32_t(20 + uniform(60)) : int32_t(uniform(5));
+    op(0x54, entry_operand(), n);
+    for (int32_t i = 0; i < n; ++i) {
+      op(uint8_t(uniform(4)));
+      put_i32(code, operand(16));
+    }
+  }
+};
+
+int main(int argc, const char *argv[]) {
+  Options opts;
+  if (!opts.parse(argc, argv)) {
+    std::cout << "Usage: " << argv[0]
+              << " [--size MB] [--mix realistic|repetitive|distinct] [--seed N] [--strings N] [-o FILE]\n";
+    return EXIT_FAILURE;
+  }
+
+  Generator gen(opts);
+  if (opts.output) {
+    std::ofstream fout(opts.output, std::ios::binary);
+    gen.run(fout);
+  } else {
+    gen.run(std::cout);
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,444 +1,3454 @@
-#include <algorithm>
-#include <cstdint>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
 #include <fstream>
-#include <functional>
-#include <iomanip>
-#include <ios>
-#include <iostream>
+#include <map>
+#include <new>
+#include <optional>
 #include <sstream>
-#include <stdexcept>
+#include <thread>
 #include <tuple>
-#include <unordered_map>
-#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bytecode.hpp"
+
+#ifdef BYTECODE_INSTRUMENT
+#include "alloc_hooks.hpp" // counts for the phases
+#endif
+
+// #####################################################################
+// ##                       Control-flow graph                        ##
+// #####################################################################
+
+// Instructions after which control does not fall through to the next one unconditionally
+constexpr bool ends_block(uint8_t opcode) noexcept {
+  switch (opcode) {
+  case 0x15: // JMP
+  case 0x16: // END
+  case 0x17: // RET
+  case 0x50: // CJMPz
+  case 0x51: // CJMPnz
+  case 0x59: // FAIL
+    return true;
+  default: return false;
+  }
+}
+
+// Adjacency lists in compressed sparse row layout: the targets of node v are
+// targets[begin[v] .. begin[v + 1])
+struct CsrGraph {
+  Column<uint32_t> begin;
+  Column<uint32_t> targets;
+
+  size_t size() const noexcept { return begin.empty() ? 0 : begin.size() - 1; }
+
+  std::pair<const uint32_t *, const uint32_t *> operator[](size_t v) const noexcept {
+    return {targets.data() + begin[v], targets.data() + begin[v + 1]};
+  }
+};
+
+// Basic blocks of a decoded program. Flow edges stay inside a function (jumps and fall-through),
+// call edges lead from the block of a CALL or CLOSURE to the function entry it names.
+// Jump and call targets that are not instruction boundaries are dropped
+struct ControlFlowGraph {
+  Column<uint32_t> block_begin; // first instruction of each block, plus the program size as a sentinel
+  CsrGraph         flow;
+  CsrGraph         calls;
+  Column<uint32_t> entries; // blocks of the public symbols, or the first block if there are none
+
+  std::shared_ptr<const void> backing; // see DecodedProgram::backing
+
+  void build(const DecodedProgram &prog) {
+    ScopedPhase       phase(PHASE_DECODE);
+    size_t            n = prog.size();
+    std::vector<bool> leader(n);
+    auto              mark = [&](int32_t offset) {
+      size_t i = prog.index_of(uint32_t(offset));
+      if (i != n) leader[i] = true;
+    };
+
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t opcode = prog.opcodes[i];
+      switch (opcode) {
+      case 0x52: // BEGIN
+      case 0x53: // CBEGIN
+        leader[i] = true;
+        break;
+      case 0x15: // JMP
+      case 0x50: // CJMPz
+      case 0x51: // CJMPnz
+      case 0x54: // CLOSURE
+      case 0x56: // CALL
+        mark(prog.arg0[i]);
+        break;
+      }
+      if (ends_block(opcode) && i + 1 < n) leader[i + 1] = true;
+    }
+    if (n != 0) leader[0] = true;
+
+    backing.reset();
+    std::vector<uint32_t> blocks;
+    for (size_t i = 0; i < n; ++i)
+      if (leader[i]) blocks.push_back(i);
+    blocks.push_back(n);
+    block_begin = std::move(blocks);
+
+    // Both graphs are filled block by block, so their rows come out in order
+    std::vector<uint32_t> flow_begin{0}, flow_targets, call_begin{0}, call_targets;
+    for (size_t b = 0; b < size(); ++b) {
+      size_t last = block_begin[b + 1] - 1;
+      for (size_t i = block_begin[b]; i <= last; ++i) {
+        uint8_t opcode = prog.opcodes[i];
+        if (opcode == 0x54 || opcode == 0x56) add_edge(call_targets, prog, prog.arg0[i]);
+      }
+
+      uint8_t opcode = prog.opcodes[last];
+      if (opcode == 0x15 || opcode == 0x50 || opcode == 0x51) add_edge(flow_targets, prog, prog.arg0[last]);
+      if (!ends_block(opcode) || opcode == 0x50 || opcode == 0x51) {
+        if (b + 1 < size()) flow_targets.push_back(b + 1);
+      }
+      flow_begin.push_back(flow_targets.size());
+      call_begin.push_back(call_targets.size());
+    }
+    flow  = {std::move(flow_begin), std::move(flow_targets)};
+    calls = {std::move(call_begin), std::move(call_targets)};
+
+    std::vector<uint32_t> entry_blocks;
+    const BytecodeFile   &src = prog.source();
+    for (size_t i = 0; i < src.public_symbols_number; ++i) {
+      size_t instr = prog.index_of(src.get_public_symbol(i).offset);
+      if (instr != n) entry_blocks.push_back(block_of(instr));
+    }
+    if (src.public_symbols_number == 0 && n != 0) entry_blocks.push_back(0);
+    entries = std::move(entry_blocks);
+  }
+
+  size_t size() const noexcept { return block_begin.empty() ? 0 : block_begin.size() - 1; }
+
+  size_t block_of(size_t instr) const noexcept {
+    return std::upper_bound(block_begin.begin(), block_begin.end(), instr) - block_begin.begin() - 1;
+  }
+
+  // Blocks reachable from the entries through flow and call edges
+  std::vector<bool> reachable() const {
+    std::vector<bool>     seen(size());
+    std::vector<uint32_t> stack;
+    for (uint32_t b : entries) {
+      if (!seen[b]) stack.push_back(b);
+      seen[b] = true;
+    }
+    while (!stack.empty()) {
+      uint32_t b = stack.back();
+      stack.pop_back();
+      for (const CsrGraph *g : {&flow, &calls}) {
+        auto [it, end] = (*g)[b];
+        for (; it != end; ++it) {
+          if (seen[*it]) continue;
+          seen[*it] = true;
+          stack.push_back(*it);
+        }
+      }
+    }
+    return seen;
+  }
+
+  struct Loops {
+    std::vector<uint32_t> depth;          // of every block, 0 outside of loops
+    size_t                n_loops     = 0;
+    size_t                n_reentries = 0; // edges entering a loop other than through its header
+  };
+
+  // Loop nesting over flow edges in one depth-first pass per function, after Wei et al.,
+  // "A New Algorithm for Identifying Loops in Decompilation": every block gets the header
+  // of its innermost loop, and headers are chained to the headers of the loops around them.
+  // Irreducible loops are kept, headed by the block the search entered them through
+  Loops loops() const;
+
+private:
+  void add_edge(std::vector<uint32_t> &targets, const DecodedProgram &prog, int32_t offset) {
+    size_t instr = prog.index_of(uint32_t(offset));
+    if (instr != prog.size()) targets.push_back(block_of(instr));
+  }
+};
+
+ControlFlowGraph::Loops ControlFlowGraph::loops() const {
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  size_t                n = size();
+  std::vector<uint32_t> header(n, NONE); // innermost loop header of each block
+  std::vector<uint32_t> position(n, 0);  // on the search path, 1-based, 0 once left
+  std::vector<bool>     visited(n), is_header(n);
+  Loops                 res;
+
+  // Merges the loop header list of b with the header h
+  auto tag = [&](uint32_t b, uint32_t h) {
+    if (b == h || h == NONE) return;
+    uint32_t cur1 = b, cur2 = h;
+    while (header[cur1] != NONE) {
+      uint32_t ih = header[cur1];
+      if (ih == cur2) return;
+      if (position[ih] < position[cur2]) {
+        header[cur1] = cur2;
+        cur1         = cur2;
+        cur2         = ih;
+      } else {
+        cur1 = ih;
+      }
+    }
+    header[cur1] = cur2;
+  };
+
+  struct Frame {
+    uint32_t        block;
+    const uint32_t *next;
+    const uint32_t *end;
+  };
+  std::vector<Frame> path;
+  auto               enter = [&](uint32_t b) {
+    visited[b]       = true;
+    position[b]      = path.size() + 1;
+    auto [next, end] = flow[b];
+    path.push_back({b, next, end});
+  };
+
+  for (uint32_t root = 0; root < n; ++root) {
+    if (visited[root]) continue;
+    enter(root);
+    while (!path.empty()) {
+      Frame &top = path.back();
+      if (top.next == top.end) {
+        uint32_t b = top.block;
+        position[b] = 0;
+        path.pop_back();
+        if (!path.empty()) tag(path.back().block, header[b]);
+        continue;
+      }
+
+      uint32_t b = *top.next++, from = top.block;
+      if (!visited[b]) {
+        enter(b);
+      } else if (position[b] > 0) {
+        // Back edge to a block on the path
+        if (!is_header[b]) res.n_loops++;
+        is_header[b] = true;
+        tag(from, b);
+      } else if (header[b] != NONE) {
+        uint32_t h = header[b];
+        if (position[h] > 0) {
+          tag(from, h);
+        } else {
+          res.n_reentries++;
+          for (h = header[h]; h != NONE; h = header[h]) {
+            if (position[h] > 0) {
+              tag(from, h);
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Headers are nested in the loops of their own headers, which come first in search order,
+  // but not necessarily in block order, so depths are resolved along the chains
+  std::vector<uint32_t> header_depth(n, 0);
+  std::vector<uint32_t> chain;
+  auto                  depth_of = [&](uint32_t h) {
+    for (uint32_t cur = h; cur != NONE && header_depth[cur] == 0; cur = header[cur]) chain.push_back(cur);
+    while (!chain.empty()) {
+      uint32_t cur      = chain.back();
+      uint32_t outer    = header[cur] == NONE ? 0 : header_depth[header[cur]];
+      header_depth[cur] = outer + 1;
+      chain.pop_back();
+    }
+    return header_depth[h];
+  };
+  res.depth.resize(n);
+  for (uint32_t b = 0; b < n; ++b) {
+    if (is_header[b]) {
+      res.depth[b] = depth_of(b);
+    } else if (header[b] != NONE) {
+      res.depth[b] = depth_of(header[b]);
+    }
+  }
+  return res;
+}
+
+// Instructions [begin, end) of the decoded program, from one BEGIN/CBEGIN up to the next
+struct Function {
+  static constexpr uint32_t NO_NAME = UINT32_MAX;
+
+  std::string name; // first public symbol at the entry, or the entry offset
+  size_t      begin       = 0;
+  size_t      end         = 0;
+  uint32_t    name_offset = NO_NAME; // of the symbol in the string table
+
+  static Function make(const DecodedProgram &prog, size_t begin, size_t end, uint32_t name_offset) {
+    Function fn;
+    fn.begin       = begin;
+    fn.end         = end;
+    fn.name_offset = name_offset;
+    if (name_offset != NO_NAME) {
+      fn.name = prog.source().get_str(name_offset);
+    } else {
+      OutputBuffer name_out(fn.name);
+      name_out.write("0x");
+      name_out.write_hex8(prog.offsets[begin]);
+    }
+    return fn;
+  }
+};
+
+// Splits the code at every BEGIN and CBEGIN. Anything before the first one, normally
+// nothing, becomes a function of its own, and the STOP at the end of code stays with the last function
+std::vector<Function> split_functions(const DecodedProgram &prog) {
+  const BytecodeFile &src     = prog.source();
+  const char         *strings = src.strings().data;
+
+  std::unordered_map<uint32_t, uint32_t> names;
+  for (size_t i = 0; i < src.public_symbols_number; ++i) {
+    BytecodeFile::PublicSymbol sym = src.get_public_symbol(i);
+    names.try_emplace(sym.offset, uint32_t(sym.name - strings));
+  }
+
+  std::vector<Function> res;
+  for (size_t i = 0; i < prog.size(); ++i) {
+    uint8_t opcode = prog.opcodes[i];
+    if (i != 0 && opcode != 0x52 && opcode != 0x53) continue;
+    if (!res.empty()) res.back().end = i;
+
+    auto it = names.find(prog.offsets[i]);
+    res.push_back(Function::make(prog, i, prog.size(), it != names.end() ? it->second : Function::NO_NAME));
+  }
+  return res;
+}
+
+// #####################################################################
+// ##                           Index file                            ##
+// #####################################################################
+
+// Everything decoded from one bytecode file, either computed or mapped from a .bcidx sidecar.
+// The graph and the functions are only built when first asked for
+struct ProgramIndex {
+  DecodedProgram prog;
+
+  void decode(const BytecodeFile &src) {
+    prog.decode(src);
+    cfg_built = false;
+    functions_list.clear();
+  }
+
+  const ControlFlowGraph &cfg() {
+    if (!cfg_built) cfg_graph.build(prog);
+    cfg_built = true;
+    return cfg_graph;
+  }
+
+  const std::vector<Function> &functions() {
+    if (functions_list.empty() && prog.size() != 0) functions_list = split_functions(prog);
+    return functions_list;
+  }
+
+  // Sidecar layout, in host byte order so that the columns can be mapped as they are:
+  //   magic "BCIDX001", u32 byte order mark, u32 0, u64 content hash of the bytecode file,
+  //   u64 XXH64 of everything after the header, u64 element count of every section,
+  //   then the sections in the order of Section, each padded to 8 bytes.
+  // Functions are stored as (begin, end, name) triples, name being a string table offset or Function::NO_NAME
+  static constexpr std::string_view MAGIC    = "BCIDX001";
+  static constexpr uint32_t         BOM      = 0x01020304;
+
+  enum Section {
+    OFFSETS,
+    OPCODES,
+    ARG0,
+    ARG1,
+    CLOSURE_INSTRS,
+    CAPTURE_BEGIN,
+    CAPTURES,
+    BLOCK_BEGIN,
+    FLOW_BEGIN,
+    FLOW_TARGETS,
+    CALL_BEGIN,
+    CALL_TARGETS,
+    ENTRIES,
+    FUNCTIONS,
+    N_SECTIONS
+  };
+
+  static constexpr size_t HEADER_SIZE = 8 + 4 + 4 + 8 + 8 + 8 * N_SECTIONS;
+
+  // Writes the sidecar through a temporary file, building whatever has not been built yet
+  void write(const BytecodeFile &src, const std::string &path) {
+    ScopedPhase phase(PHASE_OUTPUT);
+    static_assert(sizeof(Capture) == 8 && offsetof(Capture, index) == 4, "Capture is mapped as it is");
+
+    std::vector<uint32_t> fn_triples;
+    for (const Function &fn : functions()) {
+      fn_triples.insert(fn_triples.end(), {uint32_t(fn.begin), uint32_t(fn.end), fn.name_offset});
+    }
+    const ControlFlowGraph &g = cfg();
+
+    std::string  body;
+    OutputBuffer out(body);
+    size_t       counts[N_SECTIONS] = {};
+    auto         section            = [&](Section s, const auto &column) {
+      using T     = std::remove_cv_t<std::remove_reference_t<decltype(column[0])>>;
+      counts[s]   = column.size();
+      out.write({reinterpret_cast<const char *>(column.data()), column.size() * sizeof(T)});
+      for (size_t pad = -(column.size() * sizeof(T)) & 7; pad > 0; --pad) out.put(0);
+    };
+    section(OFFSETS, prog.offsets);
+    section(OPCODES, prog.opcodes);
+    section(ARG0, prog.arg0);
+    section(ARG1, prog.arg1);
+    section(CLOSURE_INSTRS, prog.closure_instrs);
+    section(CAPTURE_BEGIN, prog.capture_begin);
+    // Spelled out, so that the padding inside Capture is written as zeros
+    std::vector<char> capture_bytes(prog.captures.size() * sizeof(Capture));
+    for (size_t i = 0; i < prog.captures.size(); ++i) {
+      capture_bytes[8 * i] = char(prog.captures[i].kind);
+      std::memcpy(&capture_bytes[8 * i + 4], &prog.captures[i].index, 4);
+    }
+    out.write({capture_bytes.data(), capture_bytes.size()});
+    counts[CAPTURES] = prog.captures.size();
+    section(BLOCK_BEGIN, g.block_begin);
+    section(FLOW_BEGIN, g.flow.begin);
+    section(FLOW_TARGETS, g.flow.targets);
+    section(CALL_BEGIN, g.calls.begin);
+    section(CALL_TARGETS, g.calls.targets);
+    section(ENTRIES, g.entries);
+    section(FUNCTIONS, fn_triples);
+    out.flush();
+
+    std::string  header;
+    OutputBuffer head(header);
+    head.write(MAGIC);
+    head.write({reinterpret_cast<const char *>(&BOM), 4});
+    head.write_le(0, 4);
+    head.write_le(src.content_hash(), 8);
+    head.write_le(xxh64(body.data(), body.size()), 8);
+    for (size_t count : counts) head.write_le(count, 8);
+    head.flush();
+
+    std::string   tmp = path + ".tmp." + std::to_string(getpid());
+    std::ofstream fout(tmp, std::ios::binary);
+    fout.write(header.data(), header.size());
+    fout.write(body.data(), body.size());
+    fout.close();
+    std::error_code ec;
+    if (fout) std::filesystem::rename(tmp, path, ec);
+    if (!fout || ec) {
+      std::filesystem::remove(tmp, ec);
+      throw std::runtime_error("Cannot write " + path);
+    }
+  }
+
+  // Maps the sidecar if it describes src exactly; false (and nothing changed) if it is missing,
+  // stale, from a host of the other byte order or damaged
+  bool map(const BytecodeFile &src, const std::string &path) {
+    ScopedPhase phase(PHASE_LOAD);
+    int         fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st = {};
+    void       *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= HEADER_SIZE)
+      addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    size_t                      size = st.st_size;
+    std::shared_ptr<const void> mapping(addr, [size](const void *p) { munmap(const_cast<void *>(p), size); });
+
+    const char *base = static_cast<const char *>(addr);
+    uint32_t    bom;
+    std::memcpy(&bom, base + 8, 4);
+    if (std::string_view(base, 8) != MAGIC || bom != BOM) return false;
+    if (get_u64_le(base + 16) != src.content_hash()) return false;
+    if (get_u64_le(base + 24) != xxh64(base + HEADER_SIZE, size - HEADER_SIZE)) return false;
+
+    size_t counts[N_SECTIONS];
+    for (size_t s = 0; s < N_SECTIONS; ++s) counts[s] = get_u64_le(base + 32 + 8 * s);
+    static constexpr size_t ELEM_SIZE[N_SECTIONS] = {4, 1, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4};
+    size_t                  pos                   = HEADER_SIZE;
+    const char             *start[N_SECTIONS];
+    for (size_t s = 0; s < N_SECTIONS; ++s) {
+      if (counts[s] > (size - pos) / ELEM_SIZE[s]) return false;
+      start[s] = base + pos;
+      pos += (counts[s] * ELEM_SIZE[s] + 7) & ~size_t(7);
+      if (pos > size) return false;
+    }
+
+    // The checksum vouches for the contents, these only for the shape
+    size_t n = counts[OPCODES], n_blocks = counts[BLOCK_BEGIN] - 1;
+    if (counts[OFFSETS] != n + 1 || counts[ARG0] != n || counts[ARG1] != n
+        || counts[CAPTURE_BEGIN] != counts[CLOSURE_INSTRS] + 1 || counts[BLOCK_BEGIN] == 0
+        || counts[FLOW_BEGIN] != n_blocks + 1 || counts[CALL_BEGIN] != n_blocks + 1 || counts[FUNCTIONS] % 3 != 0)
+      return false;
+
+    auto column = [&](Section s, auto type) {
+      using T = decltype(type);
+      return Column<T>(reinterpret_cast<const T *>(start[s]), counts[s]);
+    };
+    const uint32_t *last_offset = reinterpret_cast<const uint32_t *>(start[OFFSETS]) + n;
+    if (*last_offset != src.code_size()) return false;
+
+    prog.offsets        = column(OFFSETS, uint32_t());
+    prog.opcodes        = column(OPCODES, uint8_t());
+    prog.arg0           = column(ARG0, int32_t());
+    prog.arg1           = column(ARG1, int32_t());
+    prog.closure_instrs = column(CLOSURE_INSTRS, uint32_t());
+    prog.capture_begin  = column(CAPTURE_BEGIN, uint32_t());
+    prog.captures       = column(CAPTURES, Capture());
+    prog.backing        = mapping;
+    prog.attach(src);
+
+    cfg_graph.block_begin   = column(BLOCK_BEGIN, uint32_t());
+    cfg_graph.flow.begin    = column(FLOW_BEGIN, uint32_t());
+    cfg_graph.flow.targets  = column(FLOW_TARGETS, uint32_t());
+    cfg_graph.calls.begin   = column(CALL_BEGIN, uint32_t());
+    cfg_graph.calls.targets = column(CALL_TARGETS, uint32_t());
+    cfg_graph.entries       = column(ENTRIES, uint32_t());
+    cfg_graph.backing       = mapping;
+    cfg_built               = true;
+
+    // Function names are few and short, so they are rebuilt rather than mapped
+    functions_list.clear();
+    const uint32_t *fn = reinterpret_cast<const uint32_t *>(start[FUNCTIONS]);
+    for (size_t i = 0; i < counts[FUNCTIONS]; i += 3)
+      functions_list.push_back(Function::make(prog, fn[i], fn[i + 1], fn[i + 2]));
+    phase.add_work(size, 0);
+    return true;
+  }
+
+private:
+  ControlFlowGraph      cfg_graph;
+  bool                  cfg_built = false;
+  std::vector<Function> functions_list;
+};
+
+// #####################################################################
+// ##                          Heavy hitters                          ##
+// #####################################################################
+
+// Length of the longest prefix of Space-Saving rows that is exactly the set of most frequent keys:
+// the least lower bound in it is at least the upper bound of every key after it, listed or not.
+// Rows need count and error, and must be sorted by count, descending
+template <typename Row> size_t guaranteed_prefix(const std::vector<Row> &rows, uint64_t floor) {
+  size_t   res       = 0;
+  uint64_t min_lower = UINT64_MAX;
+  for (size_t g = 1; g <= rows.size(); ++g) {
+    min_lower     = std::min(min_lower, rows[g - 1].count - rows[g - 1].error);
+    uint64_t next = g < rows.size() ? std::max(rows[g].count, floor) : floor;
+    if (min_lower >= next) res = g;
+  }
+  return res;
+}
+
+// Comment lines stating the bounds of an approximate text report
+void write_approx_header(OutputBuffer &out,
+                         const char   *what,
+                         uint64_t      total,
+                         size_t        n_counters,
+                         uint64_t      floor,
+                         size_t        certain) {
+  out.write("# approximate counts of ");
+  out.write_uint(total);
+  out.put(' ');
+  out.write(what);
+  out.write(" in ");
+  out.write_uint(n_counters);
+  out.write(" counters\n# a count may be too high by its error; unlisted ones occurred at most ");
+  out.write_uint(floor);
+  out.write(" times\n# the first ");
+  out.write_uint(certain);
+  out.write(" rows are exactly the most frequent ones\n");
+}
+
+// Approximate exact-level counts in a fixed number of Space-Saving counters, for corpora whose
+// distinct instructions do not fit in memory. Every row is an upper bound of the count with the
+// most it may be too high, and an unlisted instruction occurred at most floor() times.
+// STR operands are interned into a pool of its own and CLOSURE bytes copied once admitted;
+// both are compacted to the monitored keys whenever they have grown to twice what those need,
+// so that memory stays proportional to the counters however long the input.
+// Summaries of the same capacity merge, whichever threads filled them
+struct HeavyHitters {
+  explicit HeavyHitters(size_t capacity = 1) { reset(capacity); }
+
+  // CLOSUREs are rare, a sixteenth of the counters is left for them
+  void reset(size_t capacity) {
+    packed.reset(capacity);
+    closures.reset(std::max<size_t>(64, capacity / 16));
+    pool = std::make_unique<StringPool>();
+    for (ByteArena &a : arenas) a.clear();
+    arena_bytes  = 0;
+    compact_at   = MIN_STORAGE;
+    file_strings = {};
+    pool_offsets.clear();
+  }
+
+  void count(const DecodedProgram &prog) {
+    ScopedPhase phase(PHASE_COUNT);
+    begin_file(prog.source().strings());
+    phase.add_work(prog.offsets[prog.size()], prog.size());
+    for (size_t i = 0; i < prog.size(); ++i) {
+      if (prog.opcodes[i] == OP_CLOSURE) {
+        add_closure(prog.instr(i), 1);
+      } else {
+        add_packed(PackedKey::of(prog.opcodes[i], prog.arg0[i], prog.arg1[i]), 1);
+      }
+    }
+  }
+
+  // A validated range of the code section, as for Frequencies::parse
+  void count(const BytecodeFile &src, size_t begin, size_t end) {
+    ScopedPhase phase(PHASE_COUNT);
+    begin_file(src.strings());
+    size_t n_instrs = 0;
+    decode_unchecked(src, begin, end, [&](auto op, const auto &...) {
+      add(op.instr, 1);
+      n_instrs++;
+    });
+    phase.add_work(end - begin, n_instrs);
+  }
+
+  void count(BytecodeStream &stream) {
+    ScopedPhase phase(PHASE_COUNT);
+    begin_file(stream.strings());
+    stream.for_each_instr([&](const Instruction &instr) {
+      add(instr, 1);
+      phase.add_work(instr.size(), 1);
+    });
+  }
+
+  // Exact counts, e.g. of a binary profile
+  void add(const Frequencies &exact) {
+    ScopedPhase phase(PHASE_MERGE);
+    begin_file(exact.strings());
+    for (auto [instr, n] : exact.top({})) add(instr, n);
+  }
+
+  // The instruction bytes need not outlive the call; STR operands point into the strings of begin_file
+  void add(const Instruction &instr, uint64_t n) {
+    if (instr.opcode() == OP_CLOSURE) {
+      add_closure(instr, n);
+    } else {
+      add_packed(PackedKey::of(instr), n);
+    }
+  }
+
+  void merge(const HeavyHitters &other) {
+    ScopedPhase phase(PHASE_MERGE);
+    if (other.packed.capacity() != packed.capacity())
+      throw std::logic_error("Merging heavy hitters of different capacities");
+
+    StringTable            other_strings = other.pool->view();
+    SpaceSaving<PackedKey> other_packed  = other.packed;
+    other_packed.rekey([&](PackedKey key) {
+      if (key.has_string()) key.set_string(pool->intern(other_strings.get_view(key.string())));
+      return key;
+    });
+    packed.merge(other_packed);
+
+    SpaceSaving<InstrKey> other_closures = other.closures;
+    other_closures.rekey([&](InstrKey key) { return store(key); });
+    closures.merge(other_closures);
+    if (stored_bytes() > compact_at) compact();
+  }
+
+  uint64_t total() const noexcept { return packed.total() + closures.total(); }
+  uint64_t floor() const noexcept { return std::max(packed.floor(), closures.floor()); }
+
+  void print(std::ostream &os, const ReportOptions &report = {}) const {
+    if (report.format == Format::BIN || report.levels != LEVEL_EXACT)
+      throw std::invalid_argument("Approximate counts are reported for exact instructions only");
+    ScopedPhase  phase(PHASE_OUTPUT);
+    OutputBuffer out(os);
+    StringTable  str = pool->view();
+
+    struct Row {
+      Instruction instr;
+      uint64_t    count;
+      uint64_t    error;
+    };
+    std::vector<Row> rows;
+    KeyStorage       key_bytes(packed.size());
+    size_t           certain;
+    {
+      ScopedPhase sort_phase(PHASE_SORT);
+      for (size_t i = 0; i < packed.size(); ++i)
+        rows.push_back({packed[i].key.unpack(key_bytes[i].data()), packed[i].count, packed[i].error});
+      for (size_t i = 0; i < closures.size(); ++i)
+        rows.push_back({closures[i].key.instr, closures[i].count, closures[i].error});
+
+      // Pool offsets depend on the order strings were met in, so ties compare the strings themselves
+      std::sort(rows.begin(), rows.end(), [&](const Row &a, const Row &b) {
+        if (a.count != b.count) return a.count > b.count;
+        if (a.instr.opcode() != b.instr.opcode()) return a.instr.opcode() < b.instr.opcode();
+        if (OPCODES[a.instr.opcode()].operands == Operands::STR_INT) {
+          std::string_view x = str.get_view(get_i32_le(a.instr.data() + 1));
+          std::string_view y = str.get_view(get_i32_le(b.instr.data() + 1));
+          if (x != y) return x < y;
+        }
+        return a.instr < b.instr;
+      });
+      certain = guaranteed_prefix(rows, floor());
+      size_t n_rows = 0;
+      while (n_rows < std::min(rows.size(), report.top) && rows[n_rows].count >= report.min_count) ++n_rows;
+      rows.erase(rows.begin() + n_rows, rows.end());
+    }
+
+    if (report.format == Format::TEXT)
+      write_approx_header(out, "instructions", total(), packed.capacity() + closures.capacity(), floor(), certain);
+    if (report.format == Format::CSV && report.csv_header) out.write("count,error,certain,opcode,bytes,instruction\n");
+
+    std::string  text;
+    OutputBuffer text_out(text);
+    for (size_t r = 0; r < rows.size(); ++r) {
+      const Row &row = rows[r];
+      text.clear();
+      row.instr.print(str, text_out);
+      text_out.flush();
+
+      switch (report.format) {
+      case Format::TEXT:
+        out.write_uint(row.count);
+        out.write(" x ");
+        out.write(text);
+        if (row.error != 0) {
+          out.write("  (error <= ");
+          out.write_uint(row.error);
+          out.put(')');
+        }
+        break;
+
+      case Format::CSV:
+        out.write_uint(row.count);
+        out.put(',');
+        out.write_uint(row.error);
+        out.put(',');
+        out.put(r < certain ? '1' : '0');
+        out.put(',');
+        out.write_uint(row.instr.opcode());
+        out.put(',');
+        out.write_hex_bytes(row.instr.data(), row.instr.size());
+        out.put(',');
+        out.write_csv_quoted(text);
+        break;
+
+      case Format::JSONL:
+        out.write("{\"count\":");
+        out.write_uint(row.count);
+        out.write(",\"error\":");
+        out.write_uint(row.error);
+        out.write(r < certain ? ",\"certain\":true" : ",\"certain\":false");
+        out.write(",\"opcode\":");
+        out.write_uint(row.instr.opcode());
+        out.write(",\"bytes\":\"");
+        out.write_hex_bytes(row.instr.data(), row.instr.size());
+        out.write("\",\"instruction\":\"");
+        out.write_json_escaped(text);
+        out.write("\"}");
+        break;
+
+      case Format::BIN: break;
+      }
+      out.put('\n');
+    }
+  }
+
+  void print_stats(std::ostream &os) const {
+    os << "heavy hitters: " << packed.size() << " of " << packed.capacity() << " counters, " << closures.size()
+       << " of " << closures.capacity() << " for CLOSUREs\n";
+    os << "instructions: " << total() << ", unlisted ones at most " << floor() << " times each\n";
+    os << "stored: " << stored_bytes() << " bytes of strings and CLOSUREs\n";
+  }
+
+private:
+  static constexpr uint32_t UNSET       = UINT32_MAX;
+  static constexpr size_t   MIN_STORAGE = 64 << 10;
+
+  SpaceSaving<PackedKey>      packed;   // STR operands are offsets into pool
+  SpaceSaving<InstrKey>       closures; // bytes in arenas[cur_arena]
+  std::unique_ptr<StringPool> pool;
+  ByteArena                   arenas[2]; // the current one, and the target of the next compaction
+  size_t                      cur_arena   = 0;
+  size_t                      arena_bytes = 0;
+  size_t                      compact_at  = MIN_STORAGE;
+
+  // Pool offsets of the strings of the file being counted, looked up on first use
+  StringTable           file_strings;
+  std::vector<uint32_t> pool_offsets;
+
+  void begin_file(const StringTable &strings) {
+    file_strings = strings;
+    pool_offsets.assign(strings.size, UNSET);
+  }
+
+  size_t stored_bytes() const noexcept { return pool->view().size + arena_bytes; }
+
+  void add_packed(PackedKey key, uint64_t n) {
+    if (key.has_string()) {
+      uint32_t &off = pool_offsets[key.string()];
+      if (off == UNSET) {
+        if (stored_bytes() > compact_at) compact();
+        off = pool->intern(file_strings.get_view(key.string()));
+      }
+      key.set_string(off);
+    }
+    packed.add(key, n);
+  }
+
+  void add_closure(const Instruction &instr, uint64_t n) {
+    auto [i, admitted] = closures.add(InstrKey::of(instr), n);
+    if (!admitted) return;
+    closures.key(i) = store(closures.key(i));
+    if (stored_bytes() > compact_at) compact();
+  }
+
+  InstrKey store(InstrKey key) {
+    key.instr = Instruction(arenas[cur_arena].copy(key.instr.data(), key.instr.size()), key.instr.size());
+    arena_bytes += key.instr.size();
+    return key;
+  }
+
+  // Keeps only the strings and CLOSURE bytes of monitored keys
+  void compact() {
+    StringTable old_strings = pool->view();
+    auto        new_pool    = std::make_unique<StringPool>();
+    packed.rekey([&](PackedKey key) {
+      if (key.has_string()) key.set_string(new_pool->intern(old_strings.get_view(key.string())));
+      return key;
+    });
+    pool = std::move(new_pool);
+    std::fill(pool_offsets.begin(), pool_offsets.end(), UNSET);
+
+    size_t old_arena = cur_arena;
+    cur_arena        = 1 - cur_arena;
+    arenas[cur_arena].clear();
+    arena_bytes = 0;
+    closures.rekey([&](InstrKey key) { return store(key); });
+    arenas[old_arena].clear();
+
+    compact_at = std::max(MIN_STORAGE, 2 * stored_bytes());
+  }
+};
+
+// #####################################################################
+// ##                      Instruction sequences                      ##
+// #####################################################################
+
+// A sequence of up to four 32-bit instruction symbols, the latest in the low bits
+struct NgramKey {
+  uint64_t lo = 0;
+  uint64_t hi = 0;
+
+  static constexpr size_t MAX_N = 4;
+
+  // Shifts in the next symbol, keeping only the last n
+  void push(uint32_t symbol, size_t n) noexcept {
+    hi = hi << 32 | lo >> 32;
+    lo = lo << 32 | symbol;
+    if (n < 4) hi &= n == 3 ? 0xFFFFFFFF : 0;
+    if (n < 2) lo &= 0xFFFFFFFF;
+  }
+
+  // Symbol i of an n-gram, counting from the oldest
+  uint32_t symbol(size_t i, size_t n) const noexcept {
+    size_t back = n - 1 - i;
+    return uint32_t(back < 2 ? lo >> 32 * back : hi >> 32 * (back - 2));
+  }
+
+  size_t hash() const noexcept { return mix64(lo ^ mix64(hi + 0x9E3779B97F4A7C15ull)); }
+
+  bool operator==(const NgramKey &rhs) const noexcept { return lo == rhs.lo && hi == rhs.hi; }
+};
+
+// Counts sequences of n consecutive instructions that do not cross a basic block boundary.
+// Every distinct instruction is numbered when first seen, or stands for its opcode alone when abstract,
+// so that a sequence is a rolling key of symbols and counting costs one extra lookup per instruction.
+// With a budget of counters, sequences are kept in a Space-Saving summary instead of the table,
+// see HeavyHitters; the symbols still number every distinct instruction of the program
+struct NgramFrequencies {
+  void parse(const DecodedProgram &prog, const ControlFlowGraph &cfg, size_t n, bool abstract, size_t budget = 0) {
+    if (n < 1 || n > NgramKey::MAX_N) throw std::invalid_argument("n-gram length must be between 1 and 4");
+    clear();
+    this->n        = n;
+    this->abstract = abstract;
+    file_strings   = prog.source().strings();
+    approximate    = budget != 0;
+    if (approximate) sketch.reset(budget);
+
+    ScopedPhase phase(PHASE_COUNT);
+    phase.add_work(prog.offsets[prog.size()], prog.size());
+    for (size_t b = 0; b < cfg.size(); ++b) {
+      NgramKey key;
+      size_t   len = 0; // instructions of the block in the window
+      for (size_t i = cfg.block_begin[b]; i < cfg.block_begin[b + 1]; ++i) {
+        key.push(abstract ? prog.opcodes[i] : symbol_of(prog, i), n);
+        if (++len < n) continue;
+        if (approximate) {
+          sketch.add(key);
+        } else {
+          table.add(key);
+        }
+      }
+    }
+  }
+
+  void clear() {
+    table.clear();
+    symbols.clear();
+    closure_symbols.clear();
+    instrs.clear();
+  }
+
+  size_t distinct() const noexcept { return approximate ? sketch.size() : table.size(); }
+
+  void print(std::ostream &os, const ReportOptions &report = {}) const {
+    if (report.format == Format::BIN) throw std::invalid_argument("n-grams have no binary format");
+    ScopedPhase phase(PHASE_OUTPUT);
+
+    struct Row {
+      NgramKey key;
+      uint64_t count;
+      uint64_t error;
+    };
+    std::vector<Row> rows;
+    size_t           certain = 0;
+    {
+      ScopedPhase sort_phase(PHASE_SORT);
+      auto        by_frequency = [this](const Row &a, const Row &b) {
+        if (a.count != b.count) return a.count > b.count;
+        return less(a.key, b.key);
+      };
+      if (approximate) {
+        // The guaranteed prefix needs every row in order
+        for (size_t i = 0; i < sketch.size(); ++i) rows.push_back({sketch[i].key, sketch[i].count, sketch[i].error});
+        std::sort(rows.begin(), rows.end(), by_frequency);
+        certain       = guaranteed_prefix(rows, sketch.floor());
+        size_t n_rows = 0;
+        while (n_rows < std::min(rows.size(), report.top) && rows[n_rows].count >= report.min_count) ++n_rows;
+        rows.erase(rows.begin() + n_rows, rows.end());
+      } else {
+        table.for_each([&](NgramKey key, size_t count) {
+          if (count >= report.min_count) rows.push_back({key, count, 0});
+        });
+        if (report.top < rows.size()) {
+          std::nth_element(rows.begin(), rows.begin() + report.top, rows.end(), by_frequency);
+          rows.erase(rows.begin() + report.top, rows.end());
+        }
+        std::sort(rows.begin(), rows.end(), by_frequency);
+      }
+    }
+
+    OutputBuffer out(os);
+    std::string  text;
+    OutputBuffer text_out(text);
+    if (approximate && report.format == Format::TEXT) {
+      std::string what = std::to_string(n) + "-grams";
+      write_approx_header(out, what.c_str(), sketch.total(), sketch.capacity(), sketch.floor(), certain);
+    }
+    if (report.format == Format::CSV) out.write(approximate ? "count,error,certain,sequence\n" : "count,sequence\n");
+    for (size_t r = 0; r < rows.size(); ++r) {
+      const auto &[key, count, error] = rows[r];
+      switch (report.format) {
+      case Format::TEXT:
+        out.write_uint(count);
+        out.write(" x ");
+        for (size_t i = 0; i < n; ++i) {
+          if (i) out.write("; ");
+          print_symbol(key.symbol(i, n), out);
+        }
+        if (error != 0) {
+          out.write("  (error <= ");
+          out.write_uint(error);
+          out.put(')');
+        }
+        break;
+
+      case Format::CSV:
+        text.clear();
+        for (size_t i = 0; i < n; ++i) {
+          if (i) text_out.write("; ");
+          print_symbol(key.symbol(i, n), text_out);
+        }
+        text_out.flush();
+        out.write_uint(count);
+        out.put(',');
+        if (approximate) {
+          out.write_uint(error);
+          out.write(r < certain ? ",1," : ",0,");
+        }
+        out.write_csv_quoted(text);
+        break;
+
+      case Format::JSONL:
+        out.write("{\"count\":");
+        out.write_uint(count);
+        if (approximate) {
+          out.write(",\"error\":");
+          out.write_uint(error);
+          out.write(r < certain ? ",\"certain\":true" : ",\"certain\":false");
+        }
+        out.write(",\"sequence\":[");
+        for (size_t i = 0; i < n; ++i) {
+          text.clear();
+          print_symbol(key.symbol(i, n), text_out);
+          text_out.flush();
+          if (i) out.put(',');
+          out.put('"');
+          out.write_json_escaped(text);
+          out.put('"');
+        }
+        out.write("]}");
+        break;
+
+      case Format::BIN: break;
+      }
+      out.put('\n');
+    }
+  }
+
+  void print_stats(std::ostream &os) const {
+    if (approximate) {
+      os << "heavy hitters: " << sketch.size() << " of " << sketch.capacity() << " counters, " << sketch.total()
+         << ' ' << n << "-grams, unlisted ones at most " << sketch.floor() << " times each\n";
+      if (!abstract) os << "distinct instructions: " << instrs.size() << '\n';
+      return;
+    }
+    FlatCountTable<NgramKey>::ProbeStats st = table.probe_stats();
+    os << "distinct " << n << "-grams: " << distinct() << '\n';
+    if (!abstract) os << "distinct instructions: " << instrs.size() << '\n';
+    os << "flat table: " << st.distinct << " keys in " << st.capacity << " slots, load factor " << st.load_factor
+       << '\n';
+    os << "probe length: mean " << st.mean_probe << ", max " << st.max_probe << '\n';
+  }
+
+private:
+  FlatCountTable<NgramKey> table;
+  SpaceSaving<NgramKey>    sketch;
+  size_t                   n           = 1;
+  bool                     abstract    = false;
+  bool                     approximate = false;
+
+  // Symbols of distinct instructions, stored off by one as 0 counts mark empty slots
+  FlatFrequencyTable       symbols;
+  FlatCountTable<InstrKey> closure_symbols;
+  std::vector<Instruction> instrs; // by symbol
+  StringTable              file_strings;
+
+  uint32_t symbol_of(const DecodedProgram &prog, size_t i) {
+    uint32_t next = uint32_t(instrs.size());
+    if (prog.opcodes[i] == OP_CLOSURE) {
+      InstrKey key = InstrKey::of(prog.instr(i));
+      if (size_t symbol = closure_symbols.count(key)) return uint32_t(symbol - 1);
+      closure_symbols.add(key, next + 1);
+      instrs.push_back(prog.instr(i));
+      return next;
+    }
+    PackedKey key = PackedKey::of(prog.opcodes[i], prog.arg0[i], prog.arg1[i]);
+    if (key.has_string()) key.set_string(file_strings.canonical_of(key.string()));
+    if (size_t symbol = symbols.count(key)) return uint32_t(symbol - 1);
+    symbols.add(key, next + 1);
+    instrs.push_back(prog.instr(i));
+    return next;
+  }
+
+  void print_symbol(uint32_t symbol, OutputBuffer &out) const {
+    if (abstract) {
+      Instruction::print_shape(uint8_t(symbol), out);
+    } else {
+      instrs[symbol].print(file_strings, out);
+    }
+  }
+
+  // Orders sequences by their instructions, as Frequencies orders single ones
+  bool less(const NgramKey &a, const NgramKey &b) const {
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t x = a.symbol(i, n), y = b.symbol(i, n);
+      if (x == y) continue;
+      return abstract ? x < y : instrs[x] < instrs[y];
+    }
+    return false;
+  }
+};
+
+// #####################################################################
+// ##                   Dynamic profile (interpreter)                 ##
+// #####################################################################
+
+// Values follow the Lama runtime: integers have the low bit set,
+// anything else points to a heap object or, after LDA, to a variable
+using Value = intptr_t;
+
+constexpr Value    box(intptr_t n) noexcept { return Value(uintptr_t(n) << 1 | 1); }
+constexpr intptr_t unbox(Value v) noexcept { return v >> 1; }
+constexpr bool     is_int(Value v) noexcept { return v & 1; }
+
+struct Object {
+  enum Kind : uint8_t { STRING, ARRAY, SEXP, CLOSURE };
+
+  Kind        kind;
+  uint32_t    size  = 0;       // characters of a STRING, fields of anything else
+  const char *tag   = nullptr; // of a SEXP
+  uint32_t    entry = 0;       // of a CLOSURE, as an instruction index
+
+  // Fields (or characters) are laid out right after the header
+  Value *fields() noexcept { return reinterpret_cast<Value *>(this + 1); }
+  char  *chars() noexcept { return reinterpret_cast<char *>(this + 1); }
+};
+
+// Every opcode the interpreter dispatches on, in the order of the dispatch table
+#define VM_OPS(X)                                                                                                      \
+  X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(LT) X(LE) X(GT) X(GE) X(EQ) X(NE) X(AND) X(OR)                                  \
+  X(CONST) X(STRING) X(SEXP) X(STI) X(STA) X(JMP) X(END) X(RET) X(DROP) X(DUP) X(SWAP) X(ELEM)                         \
+  X(LD_G) X(LD_L) X(LD_A) X(LD_C) X(LDA_G) X(LDA_L) X(LDA_A) X(LDA_C) X(ST_G) X(ST_L) X(ST_A) X(ST_C)                  \
+  X(CJMPZ) X(CJMPNZ) X(BEGIN) X(CLOSURE) X(CALLC) X(CALL) X(TAG) X(ARRAY) X(FAIL) X(LINE)                              \
+  X(PATT_STR) X(PATT_STRING) X(PATT_ARRAY) X(PATT_SEXP) X(PATT_REF) X(PATT_VAL) X(PATT_FUN)                            \
+  X(LREAD) X(LWRITE) X(LLENGTH) X(LSTRING) X(BARRAY) X(STOP)
+
+// Threaded dispatch through computed goto where the compiler has it, a switch otherwise
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#endif
+
+// Executes a program and counts how many times each instruction runs.
+// There is no garbage collector: the heap is only released with the interpreter
+struct Interpreter {
+  static constexpr size_t STACK_SIZE = 1 << 22;
+
+  explicit Interpreter(const DecodedProgram &prog) : prog(prog), exec_counts(prog.size()) {
+    const BytecodeFile &src = prog.source();
+    code.resize(prog.size());
+    for (size_t i = 0; i < prog.size(); ++i) {
+      Code &c = code[i];
+      c.op    = op_of(prog.opcodes[i]);
+      c.a     = prog.arg0[i];
+      c.b     = prog.arg1[i];
+      switch (c.op) {
+      case Op::JMP:
+      case Op::CJMPZ:
+      case Op::CJMPNZ:
+      case Op::CALL:
+      case Op::CLOSURE: {
+        size_t target = prog.index_of(uint32_t(c.a));
+        c.target      = target == prog.size() ? NO_TARGET : uint32_t(target);
+      } break;
+      case Op::STRING:
+      case Op::SEXP:
+      case Op::TAG: c.str = src.get_str(uint32_t(c.a)); break;
+      default: break;
+      }
+    }
+    globals.assign(src.global_area_size, box(0));
+  }
+
+  // Runs from the start of the code until main returns or STOP is reached
+  void run();
+
+  // How many times each instruction of the program has been executed
+  const std::vector<uint64_t> &counts() const noexcept { return exec_counts; }
+
+private:
+  enum class Op : uint8_t {
+#define VM_ENUM(name) name,
+    VM_OPS(VM_ENUM)
+#undef VM_ENUM
+  };
+
+  static constexpr uint32_t NO_TARGET = UINT32_MAX;
+
+  struct Code {
+    Op          op;
+    int32_t     a      = 0;
+    int32_t     b      = 0;
+    uint32_t    target = NO_TARGET; // jump, call or closure target, as an instruction index
+    const char *str    = nullptr;   // resolved STR operand
+  };
+
+  struct Frame {
+    uint32_t ret;     // instruction to return to, NO_TARGET for main
+    Value   *args;    // first argument
+    Value   *locals;  // first local, set by BEGIN
+    Object  *closure; // for CALLC, which also leaves the closure below the arguments
+    uint32_t n_args;
+    uint32_t n_locals;
+  };
+
+  const DecodedProgram &prog;
+  std::vector<Code>     code;
+  std::vector<uint64_t> exec_counts;
+  std::vector<Value>    globals;
+  ByteArena             heap;
+
+  // Fields of every closure, begin to end by address, so that references to captured variables can be checked
+  std::map<uintptr_t, uintptr_t> closure_fields;
+
+  static Op op_of(uint8_t opcode) {
+    uint8_t hi = opcode >> 4, lo = opcode & 15;
+    switch (hi) {
+    case 0: return Op(uint8_t(Op::ADD) + lo - 1);
+    case 1: {
+      static constexpr Op OPS[] = {Op::CONST, Op::STRING, Op::SEXP, Op::STI, Op::STA,  Op::JMP,
+                                   Op::END,   Op::RET,    Op::DROP, Op::DUP, Op::SWAP, Op::ELEM};
+      return OPS[lo];
+    }
+    case 2: return Op(uint8_t(Op::LD_G) + lo);
+    case 3: return Op(uint8_t(Op::LDA_G) + lo);
+    case 4: return Op(uint8_t(Op::ST_G) + lo);
+    case 5: {
+      static constexpr Op OPS[] = {Op::CJMPZ, Op::CJMPNZ, Op::BEGIN, Op::BEGIN, Op::CLOSURE, Op::CALLC,
+                                   Op::CALL,  Op::TAG,    Op::ARRAY, Op::FAIL,  Op::LINE};
+      return OPS[lo];
+    }
+    case 6: return Op(uint8_t(Op::PATT_STR) + lo);
+    case 7: return Op(uint8_t(Op::LREAD) + lo);
+    default: return Op::STOP;
+    }
+  }
+
+  Object *alloc(Object::Kind kind, uint32_t size, size_t payload) {
+    static constexpr size_t ALIGN = alignof(Object);
+    size_t                  bytes = sizeof(Object) + payload;
+    return new (heap.allocate(bytes, ALIGN)) Object{kind, size};
+  }
+
+  Object *alloc_string(std::string_view str) {
+    Object *obj = alloc(Object::STRING, str.size(), str.size() + 1);
+    std::memcpy(obj->chars(), str.data(), str.size());
+    obj->chars()[str.size()] = 0;
+    return obj;
+  }
+
+  static Object *as_object(Value v) {
+    if (is_int(v) || v == 0) throw std::runtime_error("Boxed value expected");
+    return reinterpret_cast<Object *>(v);
+  }
+
+  static intptr_t as_int(Value v) {
+    if (!is_int(v)) throw std::runtime_error("Integer expected");
+    return unbox(v);
+  }
+
+  static bool tag_equals(const char *a, const char *b) { return a == b || std::strcmp(a, b) == 0; }
+
+  // Same format as Lstring in the Lama runtime
+  static void stringify(Value v, std::string &out) {
+    if (is_int(v)) {
+      out += std::to_string(unbox(v));
+      return;
+    }
+    Object *obj = as_object(v);
+    switch (obj->kind) {
+    case Object::STRING:
+      out += '"';
+      out.append(obj->chars(), obj->size);
+      out += '"';
+      break;
+    case Object::ARRAY:
+      out += '[';
+      for (uint32_t i = 0; i < obj->size; ++i) {
+        if (i) out += ", ";
+        stringify(obj->fields()[i], out);
+      }
+      out += ']';
+      break;
+    case Object::SEXP:
+      if (std::strcmp(obj->tag, "cons") == 0) {
+        out += '{';
+        for (Value cur = v; !is_int(cur);) {
+          Object *cell = as_object(cur);
+          if (cur != v) out += ", ";
+          stringify(cell->fields()[0], out);
+          cur = cell->fields()[1];
+        }
+        out += '}';
+        break;
+      }
+      out += obj->tag;
+      if (obj->size != 0) {
+        out += " (";
+        for (uint32_t i = 0; i < obj->size; ++i) {
+          if (i) out += ", ";
+          stringify(obj->fields()[i], out);
+        }
+        out += ')';
+      }
+      break;
+    case Object::CLOSURE: out += "<closure>"; break;
+    }
+  }
+};
+
+void Interpreter::run() {
+  ScopedPhase              phase(PHASE_EXECUTE);
+  std::unique_ptr<Value[]> stack(new Value[STACK_SIZE]);
+  std::vector<Frame>       frames;
+  Value                   *stack_begin = stack.get();
+  Value                   *stack_end   = stack_begin + STACK_SIZE;
+  Value                   *sp          = stack_begin;
+  uint32_t                 ip          = 0;
+
+  auto push = [&](Value v) {
+    if (sp == stack_end) throw std::runtime_error("Stack overflow");
+    *sp++ = v;
+  };
+  auto pop = [&]() -> Value {
+    if (sp == (frames.empty() ? stack_begin : frames.back().locals + frames.back().n_locals))
+      throw std::runtime_error("Stack underflow");
+    return *--sp;
+  };
+  auto jump = [&](uint32_t target) {
+    if (target == NO_TARGET) throw std::runtime_error("Jump into the middle of an instruction");
+    ip = target;
+  };
+  auto global = [&](int32_t i) -> Value & {
+    if (uint32_t(i) >= globals.size()) throw std::runtime_error("Global index out of bounds");
+    return globals[i];
+  };
+  auto local = [&](int32_t i) -> Value & {
+    Frame &f = frames.back();
+    if (uint32_t(i) >= f.n_locals) throw std::runtime_error("Local index out of bounds");
+    return f.locals[i];
+  };
+  auto arg = [&](int32_t i) -> Value & {
+    Frame &f = frames.back();
+    if (uint32_t(i) >= f.n_args) throw std::runtime_error("Argument index out of bounds");
+    return f.args[i];
+  };
+  auto captured = [&](int32_t i) -> Value & {
+    Object *c = frames.back().closure;
+    if (!c || uint32_t(i) >= c->size) throw std::runtime_error("Closure index out of bounds");
+    return c->fields()[i];
+  };
+  auto variable = [&](uint8_t kind, int32_t i) -> Value & {
+    switch (kind) {
+    case 0: return global(i);
+    case 1: return local(i);
+    case 2: return arg(i);
+    default: return captured(i);
+    }
+  };
+  // What STI and STA store through: LDA leaves a global, a slot of the stack or a captured variable
+  auto reference = [&](Value ref) -> Value & {
+    uintptr_t addr   = uintptr_t(ref);
+    auto      within = [&](const Value *begin, const Value *end) {
+      return addr >= uintptr_t(begin) && addr < uintptr_t(end);
+    };
+    bool valid = within(globals.data(), globals.data() + globals.size()) || within(stack_begin, sp);
+    if (!valid) {
+      auto it = closure_fields.upper_bound(addr);
+      valid   = it != closure_fields.begin() && addr < std::prev(it)->second;
+    }
+    if (!valid || addr % alignof(Value) != 0) throw std::runtime_error("Reference expected");
+    return *reinterpret_cast<Value *>(addr);
+  };
+  auto call = [&](uint32_t target, int32_t n_args, Object *closure) {
+    if (n_args < 0 || sp - stack_begin < n_args + (closure ? 1 : 0)) throw std::runtime_error("Stack underflow");
+    frames.push_back({ip + 1, sp - n_args, sp, closure, uint32_t(n_args), 0});
+    jump(target);
+  };
+
+  // main gets two dummy arguments, as in the Lama runtime
+  push(box(0));
+  push(box(0));
+  frames.push_back({NO_TARGET, stack_begin, sp, nullptr, 2, 0});
+
+#ifdef VM_THREADED
+  static const void *const LABELS[] = {
+#define VM_LABEL(name) &&L_##name,
+      VM_OPS(VM_LABEL)
+#undef VM_LABEL
+  };
+  std::vector<const void *> threaded(code.size());
+  for (size_t i = 0; i < code.size(); ++i) threaded[i] = LABELS[size_t(code[i].op)];
+
+#define VM_CASE(name) L_##name:
+#define VM_NEXT()                                                                                                      \
+  do {                                                                                                                 \
+    if (ip >= code.size()) throw std::runtime_error("EOF");                                                            \
+    ++exec_counts[ip];                                                                                                 \
+    goto *threaded[ip];                                                                                                \
+  } while (0)
+
+  VM_NEXT();
+#else
+#define VM_CASE(name) case Op::name:
+#define VM_NEXT() continue
+
+  for (;;) {
+    if (ip >= code.size()) throw std::runtime_error("EOF");
+    ++exec_counts[ip];
+    switch (code[ip].op) {
+#endif
+
+#define VM_BINOP(name, expr)                                                                                           \
+  VM_CASE(name) {                                                                                                      \
+    intptr_t y = as_int(pop()), x = as_int(pop());                                                                     \
+    push(box(expr));                                                                                                   \
+    ++ip;                                                                                                              \
+  }                                                                                                                    \
+  VM_NEXT();
+
+    VM_BINOP(ADD, x + y)
+    VM_BINOP(SUB, x - y)
+    VM_BINOP(MUL, x * y)
+    VM_BINOP(LT, x < y)
+    VM_BINOP(LE, x <= y)
+    VM_BINOP(GT, x > y)
+    VM_BINOP(GE, x >= y)
+    VM_BINOP(NE, x != y)
+    VM_BINOP(AND, x && y)
+    VM_BINOP(OR, x || y)
+#undef VM_BINOP
+
+    VM_CASE(DIV) {
+      intptr_t y = as_int(pop()), x = as_int(pop());
+      if (y == 0) throw std::runtime_error("Division by zero");
+      push(box(x / y));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(MOD) {
+      intptr_t y = as_int(pop()), x = as_int(pop());
+      if (y == 0) throw std::runtime_error("Division by zero");
+      push(box(x % y));
+      ++ip;
+    }
+    VM_NEXT();
+
+    // Any two values may be compared, boxed ones by identity
+    VM_CASE(EQ) {
+      Value y = pop(), x = pop();
+      push(box(x == y));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(CONST) {
+      push(box(code[ip].a));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(STRING) {
+      push(Value(alloc_string(code[ip].str)));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(SEXP) {
+      int32_t n = code[ip].b;
+      if (n < 0 || sp - stack_begin < n) throw std::runtime_error("Stack underflow");
+      Object *obj = alloc(Object::SEXP, n, n * sizeof(Value));
+      obj->tag    = code[ip].str;
+      sp -= n;
+      std::copy(sp, sp + n, obj->fields());
+      push(Value(obj));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(STI) {
+      Value v        = pop();
+      reference(pop()) = v;
+      push(v);
+      ++ip;
+    }
+    VM_NEXT();
+
+    // Either aggregate, index, value or reference, value
+    VM_CASE(STA) {
+      Value v = pop();
+      Value i = pop();
+      if (!is_int(i)) {
+        reference(i) = v;
+      } else {
+        Object  *obj = as_object(pop());
+        intptr_t idx = unbox(i);
+        if (idx < 0 || idx >= intptr_t(obj->size)) throw std::runtime_error("Index out of bounds");
+        if (obj->kind == Object::STRING) {
+          obj->chars()[idx] = char(as_int(v));
+        } else {
+          obj->fields()[idx] = v;
+        }
+      }
+      push(v);
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(JMP) { jump(code[ip].target); }
+    VM_NEXT();
+
+    VM_CASE(END) {
+      Value v   = pop();
+      Frame f   = frames.back();
+      frames.pop_back();
+      sp = f.args - (f.closure ? 1 : 0);
+      if (f.ret == NO_TARGET) return;
+      push(v);
+      ip = f.ret;
+    }
+    VM_NEXT();
+
+    // The Lama compiler never emits RET and the runtime gives it no meaning of its own,
+    // so it is not taken for END
+    VM_CASE(RET) { throw std::runtime_error("RET is not supported, functions return through END"); }
+
+    VM_CASE(DROP) {
+      pop();
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(DUP) {
+      Value v = pop();
+      push(v);
+      push(v);
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(SWAP) {
+      Value y = pop(), x = pop();
+      push(y);
+      push(x);
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(ELEM) {
+      intptr_t idx = as_int(pop());
+      Object  *obj = as_object(pop());
+      if (idx < 0 || idx >= intptr_t(obj->size)) throw std::runtime_error("Index out of bounds");
+      push(obj->kind == Object::STRING ? box(uint8_t(obj->chars()[idx])) : obj->fields()[idx]);
+      ++ip;
+    }
+    VM_NEXT();
+
+#define VM_LOCATION(suffix, ref)                                                                                       \
+  VM_CASE(LD_##suffix) {                                                                                               \
+    push(ref(code[ip].a));                                                                                             \
+    ++ip;                                                                                                              \
+  }                                                                                                                    \
+  VM_NEXT();                                                                                                           \
+  VM_CASE(LDA_##suffix) {                                                                                              \
+    push(Value(&ref(code[ip].a)));                                                                                     \
+    ++ip;                                                                                                              \
+  }                                                                                                                    \
+  VM_NEXT();                                                                                                           \
+  VM_CASE(ST_##suffix) {                                                                                               \
+    Value v = pop();                                                                                                   \
+    push(v);                                                                                                           \
+    ref(code[ip].a) = v;                                                                                               \
+    ++ip;                                                                                                              \
+  }                                                                                                                    \
+  VM_NEXT();
+
+    VM_LOCATION(G, global)
+    VM_LOCATION(L, local)
+    VM_LOCATION(A, arg)
+    VM_LOCATION(C, captured)
+#undef VM_LOCATION
+
+    VM_CASE(CJMPZ) {
+      if (as_int(pop()) == 0) {
+        jump(code[ip].target);
+      } else {
+        ++ip;
+      }
+    }
+    VM_NEXT();
+
+    VM_CASE(CJMPNZ) {
+      if (as_int(pop()) != 0) {
+        jump(code[ip].target);
+      } else {
+        ++ip;
+      }
+    }
+    VM_NEXT();
+
+    VM_CASE(BEGIN) {
+      Frame  &f = frames.back();
+      int32_t n = code[ip].b;
+      if (n < 0 || stack_end - sp < n) throw std::runtime_error("Stack overflow");
+      f.locals   = sp;
+      f.n_locals = n;
+      std::fill(sp, sp + n, box(0));
+      sp += n;
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(CLOSURE) {
+      auto [begin, end] = prog.captures_of(ip);
+      uint32_t n        = end - begin;
+      Object  *obj      = alloc(Object::CLOSURE, n, n * sizeof(Value));
+      if (code[ip].target == NO_TARGET) throw std::runtime_error("Closure into the middle of an instruction");
+      obj->entry = code[ip].target;
+      for (uint32_t i = 0; i < n; ++i) obj->fields()[i] = variable(begin[i].kind, begin[i].index);
+      if (n != 0) closure_fields.emplace(uintptr_t(obj->fields()), uintptr_t(obj->fields() + n));
+      push(Value(obj));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(CALLC) {
+      int32_t n = code[ip].a;
+      if (n < 0 || sp - stack_begin < n + 1) throw std::runtime_error("Stack underflow");
+      Object *closure = as_object(sp[-n - 1]);
+      if (closure->kind != Object::CLOSURE) throw std::runtime_error("Closure expected");
+      call(closure->entry, n, closure);
+    }
+    VM_NEXT();
+
+    VM_CASE(CALL) { call(code[ip].target, code[ip].b, nullptr); }
+    VM_NEXT();
+
+    VM_CASE(TAG) {
+      Value v     = pop();
+      bool  match = false;
+      if (!is_int(v)) {
+        Object *obj = as_object(v);
+        match = obj->kind == Object::SEXP && obj->size == uint32_t(code[ip].b) && tag_equals(obj->tag, code[ip].str);
+      }
+      push(box(match));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(ARRAY) {
+      Value v = pop();
+      push(box(!is_int(v) && as_object(v)->kind == Object::ARRAY && as_object(v)->size == uint32_t(code[ip].a)));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(FAIL) {
+      throw std::runtime_error("Match failure at " + std::to_string(code[ip].a) + ":" + std::to_string(code[ip].b));
+    }
+
+    VM_CASE(LINE) { ++ip; }
+    VM_NEXT();
+
+    VM_CASE(PATT_STR) {
+      Value y = pop(), x = pop();
+      bool  match = false;
+      if (!is_int(x) && !is_int(y)) {
+        Object *a = as_object(x), *b = as_object(y);
+        match     = a->kind == Object::STRING && b->kind == Object::STRING && a->size == b->size
+             && std::memcmp(a->chars(), b->chars(), a->size) == 0;
+      }
+      push(box(match));
+      ++ip;
+    }
+    VM_NEXT();
+
+#define VM_PATT(name, kind_)                                                                                           \
+  VM_CASE(name) {                                                                                                      \
+    Value v = pop();                                                                                                   \
+    push(box(!is_int(v) && as_object(v)->kind == Object::kind_));                                                      \
+    ++ip;                                                                                                              \
+  }                                                                                                                    \
+  VM_NEXT();
+
+    VM_PATT(PATT_STRING, STRING)
+    VM_PATT(PATT_ARRAY, ARRAY)
+    VM_PATT(PATT_SEXP, SEXP)
+    VM_PATT(PATT_FUN, CLOSURE)
+#undef VM_PATT
+
+    VM_CASE(PATT_REF) {
+      push(box(!is_int(pop())));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(PATT_VAL) {
+      push(box(is_int(pop())));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(LREAD) {
+      int n = 0;
+      std::printf("> ");
+      std::fflush(stdout);
+      if (std::scanf("%d", &n) != 1) throw std::runtime_error("Lread: integer expected");
+      push(box(n));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(LWRITE) {
+      std::printf("%" PRIdPTR "\n", as_int(pop()));
+      push(box(0));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(LLENGTH) {
+      push(box(as_object(pop())->size));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(LSTRING) {
+      std::string str;
+      stringify(pop(), str);
+      push(Value(alloc_string(str)));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(BARRAY) {
+      int32_t n = code[ip].a;
+      if (n < 0 || sp - stack_begin < n) throw std::runtime_error("Stack underflow");
+      Object *obj = alloc(Object::ARRAY, n, n * sizeof(Value));
+      sp -= n;
+      std::copy(sp, sp + n, obj->fields());
+      push(Value(obj));
+      ++ip;
+    }
+    VM_NEXT();
+
+    VM_CASE(STOP) { return; }
+
+#ifndef VM_THREADED
+    }
+  }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+// #####################################################################
+// ##                         Prefetching input                       ##
+// #####################################################################
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define BYTECODE_HAVE_IO_URING 1
+#endif
+
+#ifdef BYTECODE_HAVE_IO_URING
+// Just enough io_uring for a single thread to keep many reads in flight, straight on the system calls
+struct IoRing {
+  IoRing() = default;
+  IoRing(const IoRing &) = delete;
+  IoRing &operator=(const IoRing &) = delete;
+  ~IoRing() {
+    if (sqes) munmap(sqes, n_entries * sizeof(io_uring_sqe));
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring) munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0) close(ring_fd);
+  }
+
+  // False when the kernel, or a seccomp filter in front of it, has no io_uring with plain reads (Linux 5.6)
+  bool open(unsigned entries) {
+    io_uring_params p = {};
+    ring_fd           = int(syscall(__NR_io_uring_setup, entries, &p));
+    if (ring_fd < 0 || !(p.features & IORING_FEAT_RW_CUR_POS)) return false;
+
+    n_entries    = p.sq_entries;
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single  = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+    sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+    sqes    = static_cast<io_uring_sqe *>(map(n_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+    if (!sq_ring || !cq_ring || !sqes) return false;
+
+    char *sq = static_cast<char *>(sq_ring), *cq = static_cast<char *>(cq_ring);
+    sq_tail  = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask  = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    cq_head  = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail  = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask  = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes     = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    return true;
+  }
+
+  // Reads in flight at most, queued or submitted
+  unsigned capacity() const noexcept { return n_entries; }
+
+  // Queues a read of n bytes at offset of fd into buf, submitted by the next wait
+  void read(int fd, char *buf, unsigned n, uint64_t offset, uint64_t tag) noexcept {
+    unsigned      tail = *sq_tail;
+    unsigned      i    = tail & sq_mask;
+    io_uring_sqe &sqe  = sqes[i];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_READ;
+    sqe.fd        = fd;
+    sqe.addr      = uint64_t(uintptr_t(buf));
+    sqe.len       = n;
+    sqe.off       = offset;
+    sqe.user_data = tag;
+    sq_array[i]   = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    n_queued++;
+  }
+
+  // Submits the queued reads and waits for at least one to complete
+  void wait() {
+    for (;;) {
+      long n = syscall(__NR_io_uring_enter, ring_fd, n_queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (n >= 0) {
+        n_queued -= unsigned(n);
+        return;
+      }
+      if (errno != EINTR && errno != EAGAIN) throw std::runtime_error(std::string("io_uring: ") + std::strerror(errno));
+    }
+  }
+
+  // Takes a completion: its tag, and the bytes read or minus errno. False if there is none yet
+  bool reap(uint64_t &tag, int32_t &res) noexcept {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+    const io_uring_cqe &cqe = cqes[head & cq_mask];
+    tag                     = cqe.user_data;
+    res                     = cqe.res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+private:
+  int           ring_fd      = -1;
+  unsigned      n_entries    = 0;
+  unsigned      n_queued     = 0;
+  void         *sq_ring      = nullptr;
+  void         *cq_ring      = nullptr;
+  size_t        sq_ring_size = 0;
+  size_t        cq_ring_size = 0;
+  io_uring_sqe *sqes         = nullptr;
+  io_uring_cqe *cqes         = nullptr;
+  unsigned     *sq_tail      = nullptr;
+  unsigned     *sq_array     = nullptr;
+  unsigned     *cq_head      = nullptr;
+  unsigned     *cq_tail      = nullptr;
+  unsigned      sq_mask      = 0;
+  unsigned      cq_mask      = 0;
+
+  void *map(size_t size, off_t offset) noexcept {
+    void *res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return res == MAP_FAILED ? nullptr : res;
+  }
+};
+#endif
+
+// Reads whole files on a thread of its own, ahead of the workers that count them, so that counting
+// overlaps with storage latency. With io_uring every file of the window is read at once;
+// otherwise files are read one by one, with the kernel told to read ahead the rest of the window.
+// At most `depth` files are buffered, read or being read at any time, and their buffers are reused
+struct Prefetcher {
+  struct File {
+    static constexpr size_t NONE = SIZE_MAX;
+
+    size_t            task = NONE; // index of the path, NONE until next hands out a file
+    std::vector<char> data;
+    std::string       error; // why the file could not be read, if it could not
+  };
+
+  Prefetcher(const std::vector<std::string> &paths, size_t depth)
+      : paths(paths), depth(std::max<size_t>(1, depth)), reader([this] { run(); }) {}
+
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  ~Prefetcher() {
+    {
+      std::lock_guard lock(mutex);
+      stop = true;
+    }
+    space.notify_all();
+    reader.join();
+  }
+
+  // Replaces file by the next one read, in whatever order reads complete, and recycles its old buffer.
+  // False once every file has been handed out
+  bool next(File &file) {
+    std::unique_lock lock(mutex);
+    if (file.task != File::NONE) {
+      free_buffers.push_back(std::move(file.data));
+      file.task = File::NONE;
+      n_outstanding--;
+      space.notify_one();
+    }
+    auto start = std::chrono::steady_clock::now();
+    ready.wait(lock, [&] { return !queue.empty() || finished; });
+    wait_time += std::chrono::steady_clock::now() - start;
+    if (queue.empty()) return false;
+    file = std::move(queue.front());
+    queue.pop_front();
+    return true;
+  }
+
+  // Where the reads went, and how long workers spent waiting for them
+  const char *backend() const noexcept { return backend_name; }
+  size_t      bytes_read() const noexcept { return n_bytes; }
+  double      seconds_waited() const noexcept { return std::chrono::duration<double>(wait_time).count(); }
+
+private:
+  const std::vector<std::string> &paths;
+  size_t                          depth;
+
+  std::mutex                     mutex;
+  std::condition_variable        ready; // a file was queued, or there are no more
+  std::condition_variable        space; // a buffer came back, or the prefetcher is going away
+  std::deque<File>               queue;
+  std::vector<std::vector<char>> free_buffers;
+  size_t                         n_outstanding = 0; // files being read, queued or held by workers
+  bool                           finished      = false;
+  bool                           stop          = false;
+  const char                    *backend_name  = "read";
+  size_t                         n_bytes       = 0;
+  std::chrono::nanoseconds       wait_time{0};
+
+  std::thread reader; // last, so that everything above exists when it starts
+
+  void run() {
+#ifdef BYTECODE_HAVE_IO_URING
+    IoRing ring;
+    if (ring.open(unsigned(std::min<size_t>(depth, 256)))) {
+      backend_name = "io_uring";
+      run_ring(ring);
+    } else {
+      run_read();
+    }
+#else
+    run_read();
+#endif
+    std::lock_guard lock(mutex);
+    finished = true;
+    ready.notify_all();
+  }
+
+  // Waits for a buffer when block, and takes it along with a slot of the window if there is one
+  bool acquire(bool block, std::vector<char> &buf) {
+    std::unique_lock lock(mutex);
+    if (block) space.wait(lock, [&] { return n_outstanding < depth || stop; });
+    if (stop || n_outstanding >= depth) return false;
+    n_outstanding++;
+    if (!free_buffers.empty()) {
+      buf = std::move(free_buffers.back());
+      free_buffers.pop_back();
+    }
+    return true;
+  }
+
+  void deliver(File &&file) {
+    std::lock_guard lock(mutex);
+    n_bytes += file.data.size();
+    queue.push_back(std::move(file));
+    ready.notify_one();
+  }
+
+  void fail(File &&file, const std::string &why) {
+    file.data.clear();
+    file.error = why;
+    deliver(std::move(file));
+  }
+
+  // Opens a file and sizes its buffer, delivering it with an error if either fails
+  int open_file(File &file, struct stat &st) {
+    const std::string &path = paths[file.task];
+    int                fd   = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      fail(std::move(file), std::string("Cannot open ") + path + ": " + std::strerror(errno));
+      return -1;
+    }
+    if (fstat(fd, &st) != 0) st.st_mode = 0;
+    file.data.resize(S_ISREG(st.st_mode) ? size_t(st.st_size) : 0);
+    return fd;
+  }
+
+  // Plain reads, also for what is not a regular file and so has no size upfront
+  void read_whole(File &&file, int fd, bool regular) {
+    size_t done = 0;
+    for (;;) {
+      if (!regular && done == file.data.size()) file.data.resize(std::max<size_t>(1 << 16, 2 * done));
+      if (done == file.data.size()) break;
+      ssize_t n = ::read(fd, file.data.data() + done, file.data.size() - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        close(fd);
+        return fail(std::move(file), std::string("Cannot read ") + paths[file.task] + ": " + std::strerror(errno));
+      }
+      if (n == 0) break;
+      done += size_t(n);
+    }
+    close(fd);
+    file.data.resize(done);
+    deliver(std::move(file));
+  }
+
+  // One file at a time, with POSIX_FADV_WILLNEED for the ones after it in the window
+  void run_read() {
+    size_t advised = 0;
+    for (size_t task = 0; task < paths.size(); ++task) {
+      File file;
+      file.task = task;
+      if (!acquire(true, file.data)) return;
+      for (advised = std::max(advised, task + 1); advised < std::min(paths.size(), task + depth); ++advised) {
+        int fd = ::open(paths[advised].c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+      }
+
+      struct stat st = {};
+      int         fd = open_file(file, st);
+      if (fd >= 0) read_whole(std::move(file), fd, S_ISREG(st.st_mode));
+    }
+  }
+
+#ifdef BYTECODE_HAVE_IO_URING
+  // Every file of the window in flight at once; short reads are resubmitted for the rest
+  void run_ring(IoRing &ring) {
+    static constexpr size_t MAX_READ = 1 << 30;
+
+    struct Slot {
+      File   file;
+      int    fd   = -1;
+      size_t done = 0;
+    };
+    std::vector<Slot>   slots(ring.capacity());
+    std::vector<size_t> free_slots;
+    for (size_t s = slots.size(); s-- > 0;) free_slots.push_back(s);
+    auto submit = [&](size_t s) {
+      Slot  &slot = slots[s];
+      size_t n    = std::min(MAX_READ, slot.file.data.size() - slot.done);
+      ring.read(slot.fd, slot.file.data.data() + slot.done, unsigned(n), slot.done, s);
+    };
+
+    size_t task = 0;
+    try {
+      for (;;) {
+        while (task < paths.size() && !free_slots.empty()) {
+          File file;
+          file.task = task;
+          if (!acquire(free_slots.size() == slots.size(), file.data)) break;
+          task++;
+
+          struct stat st = {};
+          int         fd = open_file(file, st);
+          if (fd < 0) continue;
+          if (!S_ISREG(st.st_mode) || file.data.empty()) {
+            read_whole(std::move(file), fd, S_ISREG(st.st_mode));
+            continue;
+          }
+          size_t s = free_slots.back();
+          free_slots.pop_back();
+          slots[s] = {std::move(file), fd, 0};
+          submit(s);
+        }
+        if (free_slots.size() == slots.size()) {
+          std::lock_guard lock(mutex);
+          if (task == paths.size() || stop) return;
+          continue;
+        }
+
+        ring.wait();
+        uint64_t s;
+        int32_t  res;
+        while (ring.reap(s, res)) {
+          Slot &slot = slots[s];
+          if (res > 0) slot.done += size_t(res);
+          if (res > 0 && slot.done < slot.file.data.size()) {
+            submit(s);
+            continue;
+          }
+          close(slot.fd);
+          if (res < 0) {
+            std::string why = std::string("Cannot read ") + paths[slot.file.task] + ": " + std::strerror(-res);
+            fail(std::move(slot.file), why);
+          } else {
+            // A file that shrank since fstat is taken as it is now
+            slot.file.data.resize(slot.done);
+            deliver(std::move(slot.file));
+          }
+          free_slots.push_back(s);
+        }
+      }
+    } catch (const std::exception &e) {
+      // The ring itself failed: whatever was not read is reported as failed
+      for (size_t s = 0; s < slots.size(); ++s) {
+        if (std::find(free_slots.begin(), free_slots.end(), s) != free_slots.end()) continue;
+        close(slots[s].fd);
+        fail(std::move(slots[s].file), e.what());
+      }
+      for (; task < paths.size(); ++task) {
+        File file;
+        file.task = task;
+        {
+          std::lock_guard lock(mutex);
+          n_outstanding++;
+        }
+        fail(std::move(file), e.what());
+      }
+    }
+  }
+#endif
+};
 
 // #####################################################################
-// ##                        Utility functions                        ##
+// ##                        Parallel counting                        ##
 // #####################################################################
 
-// We don't have guarantees that our platform is little-endian,
-// which is the assumption in byterun.c
+// Runs f(task, worker) for every task in [0, n_tasks) on n_workers threads
+template <typename F> void parallel_for(size_t n_tasks, size_t n_workers, F &&f) {
+  n_workers = std::max<size_t>(1, std::min(n_workers, n_tasks));
+  std::atomic<size_t> next{0};
+  auto                work = [&](size_t worker) {
+    for (size_t task; (task = next.fetch_add(1, std::memory_order_relaxed)) < n_tasks;) f(task, worker);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t w = 1; w < n_workers; ++w) threads.emplace_back(work, w);
+  work(0);
+  for (std::thread &t : threads) t.join();
+}
+
+// Offsets of instruction boundaries splitting the code into chunks of at least min_chunk bytes.
+// Offsets of instruction boundaries splitting the code into chunks of about min_chunk bytes or more.
+// and every instruction is validated, so the chunks can be counted unchecked.
+// The last element is the end of code.
+// The scan runs on n_workers threads, one stretch of code per chunk: each stretch is decoded
+// as if it began on an instruction boundary, marking every boundary met. Then the true boundary
+// entering each stretch (where the one before ended) is followed until it meets a marked offset;
+// from there on both decodings agree, so only a few instructions per seam are decoded twice
+std::vector<size_t> chunk_boundaries(const BytecodeFile &src, size_t n_chunks, size_t min_chunk, size_t n_workers) {
+  // Stretches start on a multiple of 64, so that each one sets whole words of marks of its own
+  static constexpr size_t WORD = 64;
+
+  size_t size = src.code_size();
+  size_t step = std::max(min_chunk, size / std::max<size_t>(1, n_chunks));
+  step        = std::max(WORD, (step + WORD - 1) / WORD * WORD);
 
-int32_t get_i32_le(const char *bytes) {
-  int32_t res = 0;
-  for (int i = 0; i < 4; ++i) {
-    int byte = int(bytes[i]) & 0xFF;
-    res |= int32_t(byte) << 8 * i;
+  struct Stretch {
+    size_t exit   = 0;     // first boundary at or past the end of the stretch, or where decoding failed
+    bool   failed = false; // the guess at its start was wrong or the code is damaged; decoded again below
+  };
+  std::vector<Stretch>  stretches((size + step - 1) / step);
+  std::vector<uint64_t> marks(size / WORD + 1);
+  auto                  marked = [&](size_t off) { return marks[off / WORD] >> off % WORD & 1; };
+
+  parallel_for(stretches.size(), n_workers, [&](size_t s, size_t) {
+    size_t off = s * step, end = std::min(size, off + step);
+    try {
+      for (; off < end; off += src.get_instr(off).size()) marks[off / WORD] |= uint64_t(1) << off % WORD;
+    } catch (const std::exception &) {
+      stretches[s].failed = true;
+    }
+    stretches[s].exit = off;
+  });
+
+  std::vector<size_t> res{0};
+  size_t              off = 0; // always a true boundary
+  for (size_t s = 0; s < stretches.size(); ++s) {
+    size_t end = std::min(size, s * step + step);
+    if (off >= end) continue; // a long CLOSURE covers the whole stretch
+    if (s != 0) res.push_back(off);
+    while (off < end && !marked(off)) off += src.get_instr(off).size();
+    if (off >= end) continue;
+    // On the decoded path of the stretch now; where it failed, decoding on reports the error
+    off = stretches[s].exit;
+    if (stretches[s].failed) src.get_instr(off);
   }
+  res.push_back(size);
   return res;
 }
 
-uint32_t read_i32_le(std::istream &is) {
-  char bytes[4] = {};
-  is.read(bytes, 4);
-  return get_i32_le(bytes);
+// Counts a single large file by splitting it at instruction boundaries
+// and counting the chunks on n_workers threads
+Frequencies count_parallel(const BytecodeFile &src, size_t n_workers) {
+  // A few chunks per worker keep the threads busy when chunks differ in cost
+  static constexpr size_t CHUNKS_PER_WORKER = 4;
+  static constexpr size_t MIN_CHUNK         = 256 << 10;
+
+  std::vector<size_t> bounds   = chunk_boundaries(src, n_workers * CHUNKS_PER_WORKER, MIN_CHUNK, n_workers);
+  size_t              n_chunks = bounds.size() - 1;
+  if (n_chunks <= 1) {
+    Frequencies freq;
+    freq.parse(src, 0, src.code_size());
+    return freq;
+  }
+
+  std::vector<Frequencies> per_worker(std::min(n_workers, n_chunks));
+
+  parallel_for(n_chunks, per_worker.size(), [&](size_t chunk, size_t worker) {
+    Frequencies local;
+    local.parse(src, bounds[chunk], bounds[chunk + 1]);
+    per_worker[worker].add_counts(local);
+  });
+
+  for (size_t w = 1; w < per_worker.size(); ++w) per_worker[0].add_counts(per_worker[w]);
+  return std::move(per_worker[0]);
+}
+
+// Expands directories (recursively, *.bc files only) and @listfiles (one path per line)
+void collect_inputs(const std::string &arg, std::vector<std::string> &out) {
+  namespace fs = std::filesystem;
+
+  if (!arg.empty() && arg[0] == '@') {
+    std::ifstream list(arg.substr(1));
+    if (!list) throw std::runtime_error("Cannot open list file " + arg.substr(1));
+    for (std::string line; std::getline(list, line);) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (!line.empty()) collect_inputs(line, out);
+    }
+  } else if (fs::is_directory(arg)) {
+    std::vector<std::string> found;
+    for (const fs::directory_entry &entry : fs::recursive_directory_iterator(arg)) {
+      if (entry.is_regular_file() && entry.path().extension() == ".bc") found.push_back(entry.path().string());
+    }
+    std::sort(found.begin(), found.end());
+    out.insert(out.end(), found.begin(), found.end());
+  } else {
+    out.push_back(arg);
+  }
 }
 
-// #####################################################################
-// ##                        Raw bytecode file                        ##
-// #####################################################################
+// Reads the magic with plain system calls: batches ask this of every file, and a stream would allocate its buffer.
+// Only regular files are probed, as reading a pipe would take its first bytes from the loader
+bool is_profile_file(const std::string &path) {
+  struct stat st = {};
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  char    magic[PROFILE_MAGIC.size()] = {};
+  ssize_t n                           = ::read(fd, magic, sizeof(magic));
+  close(fd);
+  return n == ssize_t(sizeof(magic)) && is_profile(magic, sizeof(magic));
+}
+
+// Contents of the file if it is a binary profile rather than bytecode
+std::optional<std::vector<char>> read_profile(const std::string &path) {
+  if (!is_profile_file(path)) return std::nullopt;
+  ScopedPhase       phase(PHASE_LOAD);
+  std::ifstream     fin(path, std::ios::binary | std::ios::ate);
+  std::vector<char> data(size_t(fin.tellg()));
+  fin.seekg(0);
+  if (!fin.read(data.data(), data.size())) throw std::runtime_error("Cannot read " + path);
+  phase.add_work(data.size(), 0);
+  return data;
+}
+
+// Binary profiles of bytecode files by content: DIR/<hash>.bcfreq, where the hash is seeded
+// with the profile magic, so that a change of format misses instead of reading stale entries
+std::string cache_path(const std::string &dir, const BytecodeFile &src) {
+  static const uint64_t SEED = xxh64(PROFILE_MAGIC.data(), PROFILE_MAGIC.size());
+  std::string           name;
+  OutputBuffer          out(name);
+  out.write_hex8(uint32_t(src.content_hash(SEED) >> 32));
+  out.write_hex8(uint32_t(src.content_hash(SEED)));
+  out.write(".bcfreq");
+  out.flush();
+  return (std::filesystem::path(dir) / name).string();
+}
+
+// Bytes of code the rows of a table stand for. A cached profile of a file accounts for
+// every instruction of it once, so anything but its code size means the entry is damaged
+size_t counted_bytes(const Frequencies &freq) {
+  size_t total = 0;
+  freq.for_each_key([&](auto key, size_t n) {
+    if constexpr (std::is_same_v<decltype(key), PackedKey>) {
+      total += OPCODES[key.opcode].size * n;
+    } else {
+      total += key.instr.size() * n;
+    }
+  });
+  return total;
+}
 
-struct Instruction;
+// Best effort: a failed write only costs a recount next time. The profile is renamed into place,
+// so that concurrent runs never see a partial one
+void store_cached(const std::string &path, const Frequencies &freq) {
+  std::ostringstream tmp_name;
+  tmp_name << path << ".tmp." << getpid() << '.' << std::this_thread::get_id();
+  std::string tmp = tmp_name.str();
 
-struct BytecodeFile {
-  uint32_t stringtab_size        = 0;
-  uint32_t global_area_size      = 0;
-  uint32_t public_symbols_number = 0;
+  ReportOptions bin;
+  bin.format = Format::BIN;
+  std::ofstream fout(tmp, std::ios::binary);
+  freq.print(fout, bin);
+  fout.close();
 
-  void load(std::istream &is) {
-    stringtab_size        = read_i32_le(is);
-    global_area_size      = read_i32_le(is);
-    public_symbols_number = read_i32_le(is);
-    std::istreambuf_iterator<char> beg{is}, end;
-    bytes = std::vector(beg, end);
+  std::error_code ec;
+  if (fout) std::filesystem::rename(tmp, path, ec);
+  if (!fout || ec) std::filesystem::remove(tmp, ec);
+}
+
+struct BatchStats {
+  size_t      failed     = 0;
+  size_t      cache_hits = 0;
+  const char *prefetch   = nullptr; // how files were read ahead, if they were
+  size_t      read_bytes = 0;
+  double      input_wait = 0; // seconds the workers spent waiting for files, summed
+};
+
+// Counts every file on a pool of workers, each keeping its own owned table,
+// and merges the per-worker tables at the end. All of them intern into one string pool,
+// so that only file tables are merged string by string. Binary profiles are merged as they are.
+// With a cache directory, files whose content was counted before are merged from their cached profile.
+// Each worker reuses its file, decoded program and tables from one file to the next,
+// so that once they have grown to the largest file, counting a file does not allocate.
+// With a prefetch window, a Prefetcher reads up to that many files ahead of the workers,
+// otherwise each worker maps its files itself. Failed files are reported and skipped
+Frequencies count_batch(const std::vector<std::string> &paths,
+                        size_t                          n_workers,
+                        size_t                          prefetch,
+                        const char                     *cache_dir,
+                        BatchStats                     &stats) {
+  n_workers = std::max<size_t>(1, std::min(n_workers, paths.size()));
+  std::vector<Frequencies> per_worker(n_workers);
+  std::atomic<size_t>      failed{0}, cache_hits{0};
+  std::mutex               err_mutex;
+  auto                     strings = std::make_shared<StringPool>();
+  for (Frequencies &f : per_worker) f.share_strings(strings);
 
-    public_symbols_start = 0;
-    stringtab_start      = public_symbols_start + 8 * public_symbols_number;
-    code_start           = stringtab_start + stringtab_size;
+  struct Scratch {
+    BytecodeFile   src;
+    DecodedProgram prog;
+    Frequencies    local;
+    Frequencies    hit;
+  };
+  std::vector<Scratch> scratch(n_workers);
 
-    if (stringtab_start >= bytes.size()) throw std::runtime_error("Incorrect metadata: public_symbols_number");
+  // contents is the whole file when prefetched, null when the worker is to read it
+  auto count_file = [&](size_t task, size_t worker, const Prefetcher::File *contents) {
+    try {
+      auto &[src, prog, local, hit] = scratch[worker];
+      if (contents) {
+        const std::vector<char> &data = contents->data;
+        if (!contents->error.empty()) throw std::runtime_error(contents->error);
+        if (is_profile(data.data(), data.size())) {
+          per_worker[worker].merge_binary(data.data(), data.size());
+          return;
+        }
+        src.load_bytes(data.data(), data.size());
+      } else {
+        if (std::optional<std::vector<char>> profile = read_profile(paths[task])) {
+          per_worker[worker].merge_binary(profile->data(), profile->size());
+          return;
+        }
+        src.load_file(paths[task].c_str());
+      }
 
-    if (code_start >= bytes.size()) throw std::runtime_error("Incorrect metadata: stringtab_size");
+      std::string cached = cache_dir ? cache_path(cache_dir, src) : std::string();
+      if (cache_dir) {
+        if (std::optional<std::vector<char>> profile = read_profile(cached)) {
+          // A damaged entry is a miss: it is recounted and overwritten, so it must not be half merged
+          try {
+            hit.clear();
+            hit.share_strings(strings);
+            hit.merge_binary(profile->data(), profile->size());
+            if (counted_bytes(hit) != src.code_size()) throw std::runtime_error("Cache entry does not match");
+            per_worker[worker].merge(hit);
+            cache_hits.fetch_add(1, std::memory_order_relaxed);
+            return;
+          } catch (const std::exception &) {
+          }
+        }
+      }
 
-    if (stringtab_size != 0 && bytes[stringtab_start + stringtab_size - 1] != 0)
-      throw std::runtime_error("Last string in table is not null-terminated");
+      prog.decode(src);
+      local.parse(prog);
+      per_worker[worker].merge(local);
+      if (cache_dir) store_cached(cached, local);
+    } catch (const std::exception &e) {
+      failed.fetch_add(1, std::memory_order_relaxed);
+      std::lock_guard lock(err_mutex);
+      std::cerr << paths[task] << ": " << e.what() << '\n';
+    }
+  };
 
-    if (!is.good()) throw std::runtime_error("IO error");
+  if (prefetch != 0) {
+    Prefetcher prefetcher(paths, prefetch);
+    parallel_for(n_workers, n_workers, [&](size_t worker, size_t) {
+      for (Prefetcher::File file; prefetcher.next(file);) count_file(file.task, worker, &file);
+    });
+    stats.prefetch   = prefetcher.backend();
+    stats.read_bytes = prefetcher.bytes_read();
+    stats.input_wait = prefetcher.seconds_waited();
+  } else {
+    parallel_for(paths.size(), n_workers, [&](size_t task, size_t worker) { count_file(task, worker, nullptr); });
   }
 
-  size_t size() const noexcept { return bytes.size(); }
-  size_t code_size() const noexcept { return size() - code_start; }
+  Frequencies total;
+  total.share_strings(strings);
+  for (const Frequencies &f : per_worker) total.merge(f);
+  total.canonicalize();
+  stats.failed     = failed;
+  stats.cache_hits = cache_hits;
+  return total;
+}
 
-  Instruction get_instr(size_t offset) const;
+// Approximate counts in capacity counters per worker, see HeavyHitters: a single bytecode file is split
+// into chunks, several files are counted whole, and stdin is streamed. Worker w takes tasks w, w + n_workers, ...,
+// and the summaries are merged in worker order, so that a run is reproducible for a given number of workers.
+// As with count_batch, failed files out of several are reported and skipped
+HeavyHitters count_approx(const std::vector<std::string> &paths,
+                          size_t                          n_workers,
+                          size_t                          capacity,
+                          BatchStats                     &stats) {
+  static constexpr size_t MIN_CHUNK = 256 << 10;
 
-  char get_byte(size_t off) const {
-    if (off >= code_size()) throw std::runtime_error("EOF");
-    return bytes[code_start + off];
+  // Pipes are streamed before anything reads from them
+  const std::string &first = paths[0];
+  if (paths.size() == 1 && (first == "-" || !std::filesystem::is_regular_file(first))) {
+    std::ifstream fin;
+    std::istream *is = &std::cin;
+    if (first != "-") {
+      fin.open(first, std::ios::binary);
+      if (!fin) throw std::runtime_error("Cannot open " + first);
+      is = &fin;
+    }
+    BytecodeStream stream;
+    stream.open(*is);
+    HeavyHitters hh(capacity);
+    hh.count(stream);
+    return hh;
   }
 
-  int32_t get_int(size_t off) const {
-    if (off + 4 > code_size()) throw std::runtime_error("EOF");
-    uint32_t res = get_i32_le(&bytes[code_start + off]);
-    off += 4;
-    return res;
+  bool                single = paths.size() == 1 && !is_profile_file(first);
+  BytecodeFile        whole;
+  std::vector<size_t> bounds;
+  if (single) {
+    whole.load_file(first.c_str());
+    bounds = chunk_boundaries(whole, n_workers, MIN_CHUNK, n_workers);
   }
+  size_t n_tasks = single ? bounds.size() - 1 : paths.size();
+  n_workers      = std::max<size_t>(1, std::min(n_workers, n_tasks));
+
+  struct Scratch {
+    BytecodeFile   src;
+    DecodedProgram prog;
+    Frequencies    profile;
+  };
+  std::vector<HeavyHitters> per_worker(n_workers);
+  std::vector<Scratch>      scratch(n_workers);
+  std::atomic<size_t>       failed{0};
+  std::mutex                err_mutex;
+  for (HeavyHitters &hh : per_worker) hh.reset(capacity);
+
+  auto count_file = [&](size_t task, size_t worker) {
+    HeavyHitters &hh                = per_worker[worker];
+    auto         &[src, prog, freq] = scratch[worker];
+    try {
+      if (std::optional<std::vector<char>> profile = read_profile(paths[task])) {
+        freq.clear();
+        freq.merge_binary(profile->data(), profile->size());
+        hh.add(freq);
+        return;
+      }
+      src.load_file(paths[task].c_str());
+      prog.decode(src);
+      hh.count(prog);
+    } catch (const std::exception &e) {
+      failed.fetch_add(1, std::memory_order_relaxed);
+      std::lock_guard lock(err_mutex);
+      std::cerr << paths[task] << ": " << e.what() << '\n';
+    }
+  };
+
+  parallel_for(n_workers, n_workers, [&](size_t worker, size_t) {
+    for (size_t task = worker; task < n_tasks; task += n_workers) {
+      if (single) {
+        per_worker[worker].count(whole, bounds[task], bounds[task + 1]);
+      } else {
+        count_file(task, worker);
+      }
+    }
+  });
+
+  for (size_t w = 1; w < n_workers; ++w) per_worker[0].merge(per_worker[w]);
+  stats.failed = failed;
+  return std::move(per_worker[0]);
+}
 
-  const char *get_str(size_t off) const {
-    if (0 > off || off >= stringtab_size) throw std::runtime_error("String virtual address out of bounds");
-    return &bytes[stringtab_start + off];
+// Reports every function on its own, in code order, and then all of them merged.
+// Workers count and render whole functions, so the output is only concatenated here
+void report_functions(const DecodedProgram        &prog,
+                      const std::vector<Function> &functions,
+                      size_t                       n_workers,
+                      const ReportOptions         &report,
+                      std::ostream                &os) {
+  const BytecodeFile      &src = prog.source();
+  std::vector<std::string> reports(functions.size());
+
+  n_workers = std::max<size_t>(1, std::min(n_workers, functions.size()));
+  std::vector<Frequencies> per_worker(n_workers), scratch(n_workers);
+
+  auto heading = [&](std::ostream &out, const char *name, size_t n_instrs) {
+    if (report.format == Format::TEXT) out << "## " << name << ": " << n_instrs << " instructions\n";
+  };
+
+  parallel_for(functions.size(), n_workers, [&](size_t task, size_t worker) {
+    const Function &fn    = functions[task];
+    Frequencies    &local = scratch[worker];
+    local.parse(src, prog.offsets[fn.begin], prog.offsets[fn.end]);
+
+    ReportOptions fn_report = report;
+    fn_report.function      = fn.name.c_str();
+    fn_report.csv_header    = task == 0;
+    std::ostringstream out;
+    heading(out, fn_report.function, fn.end - fn.begin);
+    local.print(out, fn_report);
+    if (report.format == Format::TEXT) out << '\n';
+    reports[task] = std::move(out).str();
+
+    per_worker[worker].add_counts(local);
+  });
+
+  for (const std::string &text : reports) os << text;
+
+  Frequencies total;
+  for (const Frequencies &f : per_worker) total.add_counts(f);
+  ReportOptions total_report = report;
+  total_report.function      = "*";
+  total_report.csv_header    = functions.empty();
+  heading(os, "all functions", prog.size());
+  total.print(os, total_report);
+}
+
+struct Options {
+  std::vector<std::string> paths;
+  size_t                   jobs        = std::max(1u, std::thread::hardware_concurrency());
+  bool                     stats       = false;
+  bool                     dynamic     = false;
+  size_t                   ngram       = 0; // sequence length, 0 counts single instructions
+  bool                     abstract    = false;
+  bool                     functions   = false;
+  bool                     reachable   = false;
+  size_t                   loop_base   = 0; // weight of an instruction is loop_base^depth, 0 to count each once
+  const char              *output      = nullptr;
+  const char              *cache_dir   = nullptr;
+  bool                     write_index = false;
+  size_t                   approx      = 0; // Space-Saving counters, 0 counts exactly
+  size_t                   prefetch    = 4; // files read ahead per job in batches, 0 maps them instead
+  bool                     diff        = false; // compares two builds
+  const char              *serve       = nullptr; // socket to answer requests on
+  const char              *client      = nullptr; // socket of a server that gets the rest of the arguments
+  std::vector<std::string> forward;
+  ReportOptions            report;
+
+  bool parse(int argc, const char *argv[]) {
+    bool levels_given = false;
+    for (int i = 1; i < argc; ++i) {
+      std::string_view arg = argv[i];
+      if (arg == "--stats") {
+        stats = true;
+      } else if (arg == "--dynamic") {
+        dynamic = true;
+      } else if (arg == "--ngram") {
+        if (++i == argc) return false;
+        ngram = std::strtoull(argv[i], nullptr, 10);
+        if (ngram < 1 || ngram > NgramKey::MAX_N) {
+          std::cerr << "--ngram takes a length from 1 to " << NgramKey::MAX_N << '\n';
+          return false;
+        }
+      } else if (arg == "--level") {
+        if (++i == argc) return false;
+        levels_given  = true;
+        report.levels = 0;
+        for (std::string_view rest = argv[i]; !rest.empty();) {
+          std::string_view name = rest.substr(0, rest.find(','));
+          rest.remove_prefix(std::min(rest.size(), name.size() + 1));
+          if (name == "exact") {
+            report.levels |= LEVEL_EXACT;
+          } else if (name == "kind") {
+            report.levels |= LEVEL_KIND;
+          } else if (name == "opcode") {
+            report.levels |= LEVEL_OPCODE;
+          } else {
+            std::cerr << "Unknown level " << name << '\n';
+            return false;
+          }
+        }
+        if (report.levels == 0) return false;
+      } else if (arg == "--reachable") {
+        reachable = true;
+      } else if (arg == "--loop-weight") {
+        if (++i == argc) return false;
+        loop_base = std::strtoull(argv[i], nullptr, 10);
+        if (loop_base == 0) return false;
+      } else if (arg == "--functions") {
+        functions = true;
+      } else if (arg == "--abstract") {
+        abstract = true;
+      } else if (arg == "--write-index") {
+        write_index = true;
+      } else if (arg == "--approx") {
+        if (++i == argc) return false;
+        approx = std::strtoull(argv[i], nullptr, 10);
+        if (approx == 0) return false;
+      } else if (arg == "--prefetch") {
+        if (++i == argc) return false;
+        prefetch = std::strtoull(argv[i], nullptr, 10);
+      } else if (arg == "--cache") {
+        if (++i == argc) return false;
+        cache_dir = argv[i];
+      } else if (arg == "--diff") {
+        diff = true;
+      } else if (arg == "--serve") {
+        if (++i == argc) return false;
+        serve = argv[i];
+      } else if (arg == "--client") {
+        // Whatever follows is the server's to parse
+        if (++i == argc) return false;
+        client = argv[i];
+        forward.assign(argv + i + 1, argv + argc);
+        return !forward.empty();
+      } else if (arg == "-o") {
+        if (++i == argc) return false;
+        output = argv[i];
+      } else if (arg == "-j" || arg == "--jobs") {
+        if (++i == argc) return false;
+        jobs = std::max(1, std::atoi(argv[i]));
+      } else if (arg == "--top") {
+        if (++i == argc) return false;
+        report.top = std::strtoull(argv[i], nullptr, 10);
+      } else if (arg == "--min-count") {
+        if (++i == argc) return false;
+        report.min_count = std::strtoull(argv[i], nullptr, 10);
+      } else if (arg == "--format") {
+        if (++i == argc) return false;
+        std::string_view fmt = argv[i];
+        if (fmt == "text") {
+          report.format = Format::TEXT;
+        } else if (fmt == "csv") {
+          report.format = Format::CSV;
+        } else if (fmt == "jsonl") {
+          report.format = Format::JSONL;
+        } else if (fmt == "bin") {
+          report.format = Format::BIN;
+        } else {
+          std::cerr << "Unknown format " << fmt << '\n';
+          return false;
+        }
+      } else if (arg.size() > 1 && arg[0] == '-') {
+        std::cerr << "Unknown option " << arg << '\n';
+        return false;
+      } else {
+        paths.emplace_back(arg);
+      }
+    }
+    // The interpreter and n-grams work on a single program
+    if (abstract && ngram == 0) return false;
+    if (ngram != 0 && (dynamic || report.format == Format::BIN || report.levels != LEVEL_EXACT)) return false;
+    // The interpreted program writes to stdout, which would corrupt a binary profile there
+    if (dynamic && report.format == Format::BIN && !output) return false;
+    if (report.format == Format::BIN && report.levels != LEVEL_EXACT) return false;
+    if (functions && (dynamic || ngram != 0 || report.format == Format::BIN)) return false;
+    bool estimate = reachable || loop_base != 0;
+    if (cache_dir && (estimate || dynamic || ngram != 0 || functions)) return false;
+    if (estimate && (dynamic || ngram != 0 || functions)) return false;
+    if (write_index && (estimate || dynamic || ngram != 0 || functions || cache_dir)) return false;
+    if (approx != 0 && (estimate || dynamic || functions || cache_dir || write_index)) return false;
+    if (approx != 0 && (report.format == Format::BIN || report.levels != LEVEL_EXACT)) return false;
+    if (serve) return paths.empty();
+    if (diff && (estimate || dynamic || ngram != 0 || functions || cache_dir || write_index || approx != 0))
+      return false;
+    // Changes per instruction and per opcode class, unless narrowed
+    if (diff && !levels_given) report.levels = LEVEL_EXACT | LEVEL_KIND | LEVEL_OPCODE;
+    if (diff) return paths.size() == 2 && report.format != Format::BIN;
+    return dynamic || ngram != 0 || functions || estimate ? paths.size() == 1 : !paths.empty();
   }
 
-private:
-  std::vector<char> bytes;
-  size_t            public_symbols_start = 0;
-  size_t            stringtab_start      = 0;
-  size_t            code_start           = 0;
+  // A single plain file (or stdin) keeps the file-backed path and its exact output order;
+  // the cache only serves batches
+  bool batch() const {
+    return cache_dir || paths.size() > 1 || (!paths[0].empty() && paths[0][0] == '@')
+        || std::filesystem::is_directory(paths[0]) || is_profile_file(paths[0]);
+  }
 };
 
+// Whole-file modes read stdin in one go
+void load_input(BytecodeFile &src, const std::string &path) {
+  if (path == "-") {
+    src.load(std::cin);
+  } else {
+    src.load_file(path.c_str());
+  }
+}
+
+// Maps the sidecar of a file when it is up to date, otherwise decodes the file itself
+void load_index(ProgramIndex &index, const BytecodeFile &src, const std::string &path) {
+  if (path == "-" || !index.map(src, path + ".bcidx")) index.decode(src);
+}
+
+// Static estimates of the run-time mix from the control-flow graph: unreachable code
+// is left out, and an instruction at loop depth d stands for BASE^d executions
+Frequencies estimate_counts(ProgramIndex &index, const Options &opts) {
+  const DecodedProgram   &prog = index.prog;
+  const ControlFlowGraph &cfg  = index.cfg();
+
+  std::vector<uint64_t> weight(cfg.size(), 1);
+  size_t                n_live = 0;
+  if (opts.reachable) {
+    std::vector<bool> live = cfg.reachable();
+    for (size_t b = 0; b < cfg.size(); ++b) {
+      weight[b] = live[b];
+      if (live[b]) n_live += cfg.block_begin[b + 1] - cfg.block_begin[b];
+    }
+    if (opts.stats)
+      std::cerr << "reachable: " << n_live << " of " << prog.size() << " instructions, "
+                << std::count(live.begin(), live.end(), true) << " of " << cfg.size() << " blocks\n";
+  }
+  if (opts.loop_base != 0) {
+    ControlFlowGraph::Loops loops = cfg.loops();
+    for (size_t b = 0; b < cfg.size(); ++b) {
+      // Saturates rather than wrapping around on deep nests
+      for (uint32_t d = 0; d < loops.depth[b] && weight[b] != 0; ++d)
+        weight[b] = weight[b] > UINT64_MAX / opts.loop_base ? UINT64_MAX : weight[b] * opts.loop_base;
+    }
+    if (opts.stats)
+      std::cerr << "loops: " << loops.n_loops << ", max depth "
+                << *std::max_element(loops.depth.begin(), loops.depth.end()) << ", irreducible entries "
+                << loops.n_reentries << '\n';
+  }
+
+  std::vector<uint64_t> counts(prog.size());
+  for (size_t b = 0; b < cfg.size(); ++b)
+    std::fill(counts.begin() + cfg.block_begin[b], counts.begin() + cfg.block_begin[b + 1], weight[b]);
+  Frequencies freq;
+  freq.parse(prog, counts);
+  return freq;
+}
+
 // #####################################################################
-// ##                      Bytecode instruction                       ##
+// ##                        Build comparison                         ##
 // #####################################################################
-// Opcodes:
-// 0xF_ => STOP
-// 0x01 => BINOP +
-// 0x02 => BINOP -
-// 0x03 => BINOP *
-// 0x04 => BINOP /
-// 0x05 => BINOP %
-// 0x06 => BINOP <
-// 0x07 => BINOP <=
-// 0x08 => BINOP >
-// 0x09 => BINOP >=
-// 0x0A => BINOP ==
-// 0x0B => BINOP !=
-// 0x0C => BINOP &&
-// 0x0D => BINOP !!
-// 0x10 => CONST INT
-// 0x11 => STRING STR
-// 0x12 => SEXP STR INT
-// 0x13 => STI
-// 0x14 => STA
-// 0x15 => JMP INT
-// 0x16 => END
-// 0x17 => RET
-// 0x18 => DROP
-// 0x19 => DUP
-// 0x1A => SWAP
-// 0x1B => ELEM
-// 0x20 => LD G(INT)
-// 0x21 => LD L(INT)
-// 0x22 => LD A(INT)
-// 0x23 => LD C(INT)
-// 0x30 => LDA G(INT)
-// 0x31 => LDA L(INT)
-// 0x32 => LDA A(INT)
-// 0x33 => LDA C(INT)
-// 0x40 => ST G(INT)
-// 0x41 => ST L(INT)
-// 0x42 => ST A(INT)
-// 0x43 => ST C(INT)
-// 0x50 => CJMPz INT
-// 0x51 => CJMPnz INT
-// 0x52 => BEGIN INT INT
-// 0x53 => CBEGIN INT INT
-// 0x54 => CLOSURE INT (INT x [BYTE, INT])
-// 0x55 => CALLC INT
-// 0x56 => CALL INT INT
-// 0x57 => TAG STR INT
-// 0x58 => ARRAY INT
-// 0x59 => FAIL INT INT
-// 0x5A => LINE INT
-// 0x60 => PATT =str
-// 0x61 => PATT #string
-// 0x62 => PATT #array
-// 0x63 => PATT #sexp
-// 0x64 => PATT #ref
-// 0x65 => PATT #val
-// 0x66 => PATT #fun
-// 0x70 => CALL Lread
-// 0x71 => CALL Lwrite
-// 0x72 => CALL Llength
-// 0x73 => CALL Lstring
-// 0x74 => CALL Barray INT
-
-// References bytecode file, therefore it must be alive
-// for the entire lifetime of the instruction
-struct Instruction {
-  Instruction(const char *start) : start(start) {}
-
-  size_t size() const {
-    char code = *start;
-    char hi   = (code >> 4) & 15;
-    char lo   = code & 15;
-    switch (hi) {
-    case 15: // STOP
-    case 0:  // BINOP
-      return 1;
-
-    case 1:
-      switch (lo) {
-      case 0: // CONST INT
-      case 1: // STRING STR
-        return 5;
-      case 2: // SEXP STR INT
-        return 9;
-      case 3: // STI
-      case 4: // STA
-        return 1;
-      case 5: // JMP INT
-        return 5;
-      case 6:  // END
-      case 7:  // RET
-      case 8:  // DROP
-      case 9:  // DUP
-      case 10: // SWAP
-      case 11: // ELEM
-        return 1;
-      }
-      break;
 
-    case 2: // LD INT
-    case 3: // LDA INT
-    case 4: // ST INT
-      return 5;
-
-    case 5:
-      switch (lo) {
-      case 0: // CJMPz INT
-      case 1: // CJMPnz INT
-        return 5;
-      case 2: // BEGIN INT INT
-      case 3: // CBEGIN INT INT
-        return 9;
-      case 4: { // CLOSURE INT (INT x [BYTE, INT])
-        int32_t len = get_i32_le(start + 5);
-        return 9 + 5 * len;
-      }
-      case 5: // CALLC INT
-        return 5;
-      case 6: // CALL INT INT
-      case 7: // TAG STR INT
-        return 9;
-      case 8: // ARRAY INT
-        return 5;
-      case 9: // FAIL INT INT
-        return 9;
-      case 10: // LINE INT
-        return 5;
+// Instruction mixes of two builds of a program, e.g. before and after a compiler upgrade.
+// Both sides are merged into tables that share one string pool, so that an instruction has
+// the same key on either side and rows are matched by lookup. Only the largest changes are reported,
+// selected before sorting; absolute changes are differences of counts, relative ones compare
+// (after + 1) / (before + 1) either way up, so that instructions new to a build rank by their count
+struct FrequencyDiff {
+  static constexpr size_t DEFAULT_TOP = 20; // rows per table unless --top says otherwise
+
+  // Counts both files at once, each on half of the workers; bytecode files and binary profiles both work
+  void count(const std::string &before_path, const std::string &after_path, size_t n_workers) {
+    const std::string *paths[2] = {&before_path, &after_path};
+    Frequencies        local[2];
+    BytecodeFile       src[2]; // file-backed tables point into them until merged
+    std::vector<char>  piped[2];
+    std::string        errors[2];
+
+    auto count_side = [&](size_t side) {
+      try {
+        if (!std::filesystem::is_regular_file(*paths[side])) {
+          // A pipe can be read only once, so the magic is looked for in what was read
+          std::ifstream fin(*paths[side], std::ios::binary);
+          if (!fin) throw std::runtime_error("Cannot open " + *paths[side]);
+          char buf[1 << 16];
+          while (fin.read(buf, sizeof(buf)) || fin.gcount() > 0)
+            piped[side].insert(piped[side].end(), buf, buf + fin.gcount());
+          if (fin.bad()) throw std::runtime_error("Cannot read " + *paths[side]);
+          if (is_profile(piped[side].data(), piped[side].size())) {
+            local[side].merge_binary(piped[side].data(), piped[side].size());
+          } else {
+            src[side].load_bytes(piped[side].data(), piped[side].size());
+            local[side] = count_parallel(src[side], std::max<size_t>(1, n_workers / 2));
+          }
+        } else if (std::optional<std::vector<char>> profile = read_profile(*paths[side])) {
+          local[side].merge_binary(profile->data(), profile->size());
+        } else {
+          src[side].load_file(paths[side]->c_str());
+          local[side] = count_parallel(src[side], std::max<size_t>(1, n_workers / 2));
+        }
+      } catch (const std::exception &e) {
+        errors[side] = *paths[side] + ": " + e.what();
       }
-      break;
+    };
+    std::thread other(count_side, 1);
+    count_side(0);
+    other.join();
+    for (const std::string &error : errors)
+      if (!error.empty()) throw std::runtime_error(error);
 
-    case 6: // PATT ...
-      return 1;
-    case 7:
-      switch (lo) {
-      case 0: // CALL Lread
-      case 1: // CALL Lwrite
-      case 2: // CALL Llength
-      case 3: // CALL Lstring
-        return 1;
-      case 4: // CALL Barray INT
-        return 5;
+    auto pool = std::make_shared<StringPool>();
+    for (size_t side = 0; side < 2; ++side) {
+      sides[side].clear();
+      sides[side].share_strings(pool);
+      sides[side].merge(local[side]);
+    }
+  }
+
+  void print(std::ostream &os, const ReportOptions &report = {}) const {
+    ScopedPhase  phase(PHASE_OUTPUT);
+    OutputBuffer out(os);
+    if (report.format == Format::BIN) throw std::invalid_argument("Differences have no binary format");
+    if (report.format == Format::CSV && report.csv_header)
+      out.write("level,order,before,after,change,relative,opcode,instruction\n");
+
+    size_t top   = report.top == SIZE_MAX ? DEFAULT_TOP : report.top;
+    bool   first = true;
+    for (Level level : {LEVEL_EXACT, LEVEL_KIND, LEVEL_OPCODE}) {
+      if (!(report.levels & level)) continue;
+      std::vector<Change> changes = level == LEVEL_EXACT ? exact_changes(report) : aggregated_changes(report, level);
+      for (Order order : {BY_ABSOLUTE, BY_RELATIVE}) {
+        if (report.format == Format::TEXT) {
+          if (!first) out.put('\n');
+          out.write("# ");
+          out.write(level_name(level));
+          out.write(order == BY_ABSOLUTE ? ", largest absolute changes\n" : ", largest relative changes\n");
+        }
+        first = false;
+        for (const Change &change : select(changes, top, order, level))
+          print_change(out, report.format, level, order, change);
       }
-      break;
     }
-    throw std::runtime_error("Invalid opcode");
   }
 
-  // Helper function to prevent UB in BytecodeFile
-  bool fits_in_size(size_t limit) const {
-    // Special case for CLOSURE,
-    // as its size is not known from the first byte
-    if (*start == 0x54 && limit < 9) return false;
-    return size() <= limit;
+  void print_stats(std::ostream &os) const {
+    for (size_t side = 0; side < 2; ++side) {
+      size_t total = 0;
+      for (size_t op = 0; op < 256; ++op) total += sides[side].opcode_count(uint8_t(op));
+      os << (side == 0 ? "before: " : "after: ") << total << " instructions, " << sides[side].distinct()
+         << " distinct\n";
+    }
   }
 
-  void print(const BytecodeFile &src, std::ostream &os) {
-    static const char *const BINOPS[] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
-    static constexpr size_t  N_BINOPS = sizeof(BINOPS) / sizeof(BINOPS[0]);
+private:
+  enum Order { BY_ABSOLUTE, BY_RELATIVE };
 
-    static const char *const MEMORY_OPS[] = {"LD", "LDA", "ST"};
-    static constexpr size_t  N_MEMORY_OPS = sizeof(MEMORY_OPS) / sizeof(MEMORY_OPS[0]);
+  // An instruction of the exact level, or an opcode of the coarser ones, with its count on either side
+  struct Change {
+    Instruction instr{nullptr, 0};
+    uint8_t     opcode = 0;
+    uint64_t    before = 0;
+    uint64_t    after  = 0;
 
-    static const char *const PATTERNS[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
-    static constexpr size_t  N_PATTERNS = sizeof(PATTERNS) / sizeof(PATTERNS[0]);
+    uint64_t magnitude() const noexcept { return before > after ? before - after : after - before; }
+    double   ratio() const noexcept {
+      double r = (double(after) + 1) / (double(before) + 1);
+      return r < 1 ? 1 / r : r;
+    }
+  };
 
-    char code = *start;
-    char hi   = (code >> 4) & 15;
-    char lo   = code & 15;
+  Frequencies sides[2];
 
-    switch (hi) {
-    case 15: os << "<end>"; break;
+  // Rows and the bytes of their keys stay in these buffers until the next call
+  mutable std::vector<Change> selected;
+  mutable KeyStorage          key_bytes;
 
-    case 0:
-      if (lo == 0 || lo > N_BINOPS) throw std::runtime_error("Invalid BINOP");
-      os << "BINOP " << BINOPS[lo - 1];
-      break;
+  std::vector<Change> exact_changes(const ReportOptions &report) const {
+    std::vector<Change> changes;
+    key_bytes.clear();
+    key_bytes.reserve(sides[0].distinct() + sides[1].distinct());
+    auto unpack = [&](auto key) {
+      if constexpr (std::is_same_v<decltype(key), PackedKey>) {
+        return key.unpack(key_bytes.emplace_back().data());
+      } else {
+        return key.instr;
+      }
+    };
+    // Rows of the second side that the first has too were seen from the first
+    for (size_t side = 0; side < 2; ++side) {
+      sides[side].for_each_key([&](auto key, size_t n) {
+        size_t other = sides[1 - side].count(key);
+        if (side == 1 && other != 0) return;
+        if (std::max<size_t>(n, other) < report.min_count) return;
+        Change change;
+        change.instr  = unpack(key);
+        change.opcode = change.instr.opcode();
+        change.before = side == 0 ? n : other;
+        change.after  = side == 0 ? other : n;
+        changes.push_back(change);
+      });
+    }
+    return changes;
+  }
 
-    case 1:
-      switch (lo) {
-      case 0: os << "CONST " << get_int(1); break;
-      case 1: os << "STRING " << get_int(1); break;
-      case 2: os << "SEXP\t" << get_str(src, 1) << ' ' << get_int(5); break;
-      case 3: os << "STI"; break;
-      case 4: os << "STA"; break;
-      case 5: os << "JMP\t0x" << std::setw(8) << std::setfill('0') << std::hex << get_int(1) << std::dec; break;
-      case 6: os << "END"; break;
-      case 7: os << "RET"; break;
-      case 8: os << "DROP"; break;
-      case 9: os << "DUP"; break;
-      case 10: os << "SWAP"; break;
-      case 11: os << "ELEM"; break;
-      default: throw std::runtime_error("Invalid opcode");
+  // Rows of the kind level are opcodes; those of the opcode level are mnemonics, under their lowest opcode
+  std::vector<Change> aggregated_changes(const ReportOptions &report, Level level) const {
+    std::vector<Change> changes;
+    for (size_t op = 0; op < 256; ++op) {
+      uint64_t before = sides[0].opcode_count(uint8_t(op)), after = sides[1].opcode_count(uint8_t(op));
+      if (before == 0 && after == 0) continue;
+      if (level == LEVEL_OPCODE) {
+        auto same = [&](const Change &c) { return bare_mnemonic(c.opcode) == bare_mnemonic(uint8_t(op)); };
+        auto it   = std::find_if(changes.begin(), changes.end(), same);
+        if (it != changes.end()) {
+          it->before += before;
+          it->after += after;
+          continue;
+        }
       }
-      break;
+      Change change;
+      change.opcode = uint8_t(op);
+      change.before = before;
+      change.after  = after;
+      changes.push_back(change);
+    }
+    changes.erase(std::remove_if(changes.begin(),
+                                 changes.end(),
+                                 [&](const Change &c) { return std::max(c.before, c.after) < report.min_count; }),
+                  changes.end());
+    return changes;
+  }
 
-    case 2:
-    case 3:
-    case 4:
-      os << MEMORY_OPS[hi - 2] << '\t';
-      switch (lo) {
-      case 0: os << 'G'; break;
-      case 1: os << 'L'; break;
-      case 2: os << 'A'; break;
-      case 3: os << 'C'; break;
-      default: throw std::runtime_error("Invalid memory operation");
-      }
-      os << '(' << get_int(1) << ')';
-      break;
+  // The top changes in order, ties broken by the larger absolute change, then by instruction
+  const std::vector<Change> &select(const std::vector<Change> &changes, size_t top, Order order, Level level) const {
+    ScopedPhase phase(PHASE_SORT);
+    auto        larger = [&](const Change &a, const Change &b) {
+      if (order == BY_RELATIVE && a.ratio() != b.ratio()) return a.ratio() > b.ratio();
+      if (a.magnitude() != b.magnitude()) return a.magnitude() > b.magnitude();
+      return level == LEVEL_EXACT ? a.instr < b.instr : a.opcode < b.opcode;
+    };
+    selected = changes;
+    if (top < selected.size()) {
+      std::nth_element(selected.begin(), selected.begin() + top, selected.end(), larger);
+      selected.erase(selected.begin() + top, selected.end());
+    }
+    std::sort(selected.begin(), selected.end(), larger);
+    return selected;
+  }
 
-    case 5:
-      switch (lo) {
-      case 0: os << "CJMPz\t0x" << std::setw(8) << std::setfill('0') << std::hex << get_int(1) << std::dec; break;
-      case 1: os << "CJMPnz\t0x" << std::setw(8) << std::setfill('0') << std::hex << get_int(1) << std::dec; break;
-      case 2: os << "BEGIN\t" << get_int(1) << ' ' << get_int(5); break;
-      case 3: os << "CBEGIN\t" << get_int(1) << ' ' << get_int(5); break;
-      case 4: {
-        os << "CLOSURE\t" << std::setw(8) << std::setfill('0') << std::hex << get_int(1) << std::dec;
-        int32_t n = get_int(5);
-        for (int32_t i = 0; i < n; ++i) {
-          switch (start[9 + 5 * i]) {
-          case 0: os << " G"; break;
-          case 1: os << " L"; break;
-          case 2: os << " A"; break;
-          case 3: os << " C"; break;
-          default: throw std::runtime_error("Invalid CLOSURE");
-          }
-          os << '(' << get_int(10 + 5 * i) << ')';
-        }
-      } break;
+  // Relative change in percent to a tenth; the first build must have the instruction.
+  // Text marks growth with a plus sign, the other formats write plain numbers
+  static void write_relative(OutputBuffer &out, const Change &change, bool plus) {
+    int64_t tenths = std::llround(1000.0 * (double(change.after) - double(change.before)) / double(change.before));
+    if (plus && tenths > 0) out.put('+');
+    if (tenths < 0) out.put('-');
+    uint64_t abs_tenths = tenths < 0 ? -uint64_t(tenths) : uint64_t(tenths);
+    out.write_uint(abs_tenths / 10);
+    out.put('.');
+    out.write_uint(abs_tenths % 10);
+  }
 
-      case 5: os << "CALLC\t" << get_int(1); break;
+  static void write_change(OutputBuffer &out, const Change &change, bool plus) {
+    if (plus && change.after > change.before) out.put('+');
+    if (change.after < change.before) out.put('-');
+    out.write_uint(change.magnitude());
+  }
 
-      case 6:
-        os << "CALL\t0x" << std::setw(8) << std::setfill('0') << std::hex << get_int(1) << std::dec << ' ' << get_int(5);
-        break;
+  void print_change(OutputBuffer &out, Format format, Level level, Order order, const Change &change) const {
+    std::string  text;
+    OutputBuffer text_out(text);
+    if (level == LEVEL_EXACT) {
+      change.instr.print(sides[0].strings(), text_out);
+    } else if (level == LEVEL_KIND) {
+      Instruction::print_shape(change.opcode, text_out);
+    } else {
+      text_out.write(bare_mnemonic(change.opcode));
+    }
+    text_out.flush();
 
-      case 7: os << "TAG\t" << get_str(src, 1) << ' ' << get_int(5); break;
-      case 8: os << "ARRAY\t" << get_int(1); break;
-      case 9: os << "FAIL\t" << get_int(1) << ' ' << get_int(5); break;
-      case 10: os << "LINE\t" << get_int(1); break;
-      default: throw std::runtime_error("Invalid opcode");
+    switch (format) {
+    case Format::TEXT:
+      write_change(out, change, true);
+      out.write(" x ");
+      out.write(text);
+      out.write(" (");
+      out.write_uint(change.before);
+      out.write(" -> ");
+      out.write_uint(change.after);
+      out.write(", ");
+      if (change.before == 0) {
+        out.write("new");
+      } else {
+        write_relative(out, change, true);
+        out.put('%');
       }
+      out.put(')');
       break;
 
-    case 6:
-      if (lo >= N_PATTERNS) throw std::runtime_error("Invalid PATT");
-      os << "PATT\t" << PATTERNS[lo];
+    case Format::CSV:
+      out.write(level_name(level));
+      out.write(order == BY_ABSOLUTE ? ",absolute," : ",relative,");
+      out.write_uint(change.before);
+      out.put(',');
+      out.write_uint(change.after);
+      out.put(',');
+      write_change(out, change, false);
+      out.put(',');
+      if (change.before != 0) write_relative(out, change, false);
+      out.put(',');
+      if (level != LEVEL_OPCODE) out.write_uint(change.opcode);
+      out.put(',');
+      out.write_csv_quoted(text);
       break;
 
-    case 7:
-      switch (lo) {
-      case 0: os << "CALL\tLread"; break;
-      case 1: os << "CALL\tLwrite"; break;
-      case 2: os << "CALL\tLlength"; break;
-      case 3: os << "CALL\tLstring"; break;
-      case 4: os << "CALL\tBarray\t" << get_int(1); break;
-      default: throw std::runtime_error("Invalid opcode");
+    case Format::JSONL:
+      out.write("{\"level\":\"");
+      out.write(level_name(level));
+      out.write(order == BY_ABSOLUTE ? "\",\"order\":\"absolute\"" : "\",\"order\":\"relative\"");
+      out.write(",\"before\":");
+      out.write_uint(change.before);
+      out.write(",\"after\":");
+      out.write_uint(change.after);
+      out.write(",\"change\":");
+      write_change(out, change, false);
+      out.write(",\"relative\":");
+      if (change.before != 0) {
+        write_relative(out, change, false);
+      } else {
+        out.write("null");
       }
+      if (level != LEVEL_OPCODE) {
+        out.write(",\"opcode\":");
+        out.write_uint(change.opcode);
+      }
+      out.write(",\"instruction\":\"");
+      out.write_json_escaped(text);
+      out.write("\"}");
       break;
 
-    deafult:
-      throw std::runtime_error("Invalid opcode");
+    case Format::BIN: break;
     }
+    out.put('\n');
   }
+};
+
+// #####################################################################
+// ##                         Analysis server                         ##
+// #####################################################################
+// --serve SOCKET answers requests on a Unix socket, keeping the files it was asked about decoded.
+// A request is a single line: the working directory of the client, then the usual arguments,
+// all separated by tabs. The reply is "ok" or "error MESSAGE" on a line of its own,
+// followed by the report, and the connection is closed. --client SOCKET ARGS... sends one such request.
 
-  bool operator<(const Instruction &rhs) const { return as_sv() < rhs.as_sv(); }
-  bool operator==(const Instruction &rhs) const { return as_sv() == rhs.as_sv(); }
+// A file kept decoded between requests, along with whatever was computed from it.
+// Contents are read rather than mapped, so that a file rewritten under the server cannot change them
+struct Resident {
+  std::mutex        mutex; // held for a whole request, as the cached tables reuse buffers when printing
+  std::vector<char> contents;
+  BytecodeFile      src;
+  ProgramIndex      index;
+  uint64_t          hash      = 0;
+  bool              loaded    = false;
+  uint64_t          last_used = 0; // guarded by the server
 
-private:
-  const char *start;
+  // What the file was when last looked at; a change of any of these rereads it
+  struct stat identity = {};
 
-  std::string_view as_sv() const { return std::string_view(start, size()); }
+  std::optional<Frequencies>                                   freq;
+  std::map<std::tuple<size_t, bool, size_t>, NgramFrequencies> ngrams; // by length, abstract, budget
 
-  int32_t     get_int(size_t off) { return get_i32_le(start + off); }
-  const char *get_str(const BytecodeFile &src, size_t off) { return src.get_str(get_int(off)); }
+  // Rereads the file if it changed since, and decodes it again if its contents did
+  void refresh(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      throw std::runtime_error("Not a regular file: " + path);
+    }
+    if (loaded && same_file(st, identity)) {
+      close(fd);
+      return;
+    }
 
-  friend struct std::hash<Instruction>;
-};
+    // One buffer of the size from fstat, filled by bulk reads; a file that shrank since is taken as it is now
+    std::vector<char> fresh(size_t(st.st_size));
+    size_t            done = 0;
+    while (done < fresh.size()) {
+      ssize_t n = ::read(fd, fresh.data() + done, fresh.size() - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error("Cannot read " + path + ": " + std::strerror(err));
+      }
+      if (n == 0) break;
+      done += size_t(n);
+    }
+    close(fd);
+    fresh.resize(done);
+    uint64_t fresh_hash = xxh64(fresh.data(), fresh.size());
+    identity            = st;
+    if (loaded && fresh_hash == hash && fresh.size() == contents.size()) return; // touched, not changed
 
-Instruction BytecodeFile::get_instr(size_t offset) const {
-  if (offset >= code_size()) throw std::runtime_error("EOF");
-  Instruction instr(&bytes[code_start + offset]);
-  if (!instr.fits_in_size(code_size() - offset)) throw std::runtime_error("EOF");
-  return instr;
-}
+    loaded = false;
+    freq.reset();
+    ngrams.clear();
+    contents = std::move(fresh);
+    hash     = fresh_hash;
+    src.load_bytes(contents.data(), contents.size());
+    load_index(index, src, path);
+    loaded = true;
+  }
 
-template <> struct std::hash<Instruction> {
-  size_t operator()(const Instruction &self) const noexcept { return std::hash<std::string_view>{}(self.as_sv()); }
+private:
+  static bool same_file(const struct stat &a, const struct stat &b) noexcept {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+  }
 };
 
-// #####################################################################
-// ##                      Counting instructions                      ##
-// #####################################################################
+struct Server {
+  static constexpr size_t MAX_RESIDENT = 32;    // files kept decoded, the least recently asked about go first
+  static constexpr size_t MAX_REQUEST  = 1 << 16;
 
-// We could make a structure holding parsed bytecodes,
-// but in this task it is unnecessary
+  // Binds the socket and answers requests until the process is killed, each connection on a thread of its own
+  [[noreturn]] void run(const char *socket_path) {
+    sockaddr_un addr = {};
+    addr.sun_family  = AF_UNIX;
+    if (std::strlen(socket_path) >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path is too long");
+    std::strcpy(addr.sun_path, socket_path);
 
-struct Frequencies {
-  void parse(const BytecodeFile &src) {
-    freq.clear();
-    pSrc = &src;
+    // A socket file nobody listens on is left over from an earlier server
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+      throw std::runtime_error(std::string("A server is already listening on ") + socket_path);
+    if (probe >= 0) close(probe);
+    unlink(socket_path);
 
-    for (size_t offset = 0; offset < src.code_size();) {
-      Instruction instr = src.get_instr(offset);
-      freq.try_emplace(instr, 0).first->second++;
-      offset += instr.size();
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0)
+      throw std::runtime_error(std::string("Cannot listen on ") + socket_path + ": " + std::strerror(errno));
+    for (;;) {
+      int client = accept(fd, nullptr, nullptr);
+      if (client < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        throw std::runtime_error(std::string("accept: ") + std::strerror(errno));
+      }
+      std::thread([this, client] {
+        answer(client);
+        close(client);
+      }).detach();
     }
   }
 
-  void print(std::ostream &os) {
-    std::vector<std::pair<Instruction, size_t>> sorted(freq.begin(), freq.end());
-    std::sort(sorted.begin(), sorted.end(), [](auto &&a, auto &&b) {
-      if (a.second != b.second) return a.second > b.second;
-      return a.first < b.first;
-    });
+private:
+  std::mutex                                                 mutex; // guards residents and clock
+  std::unordered_map<std::string, std::shared_ptr<Resident>> residents;
+  uint64_t                                                   clock = 0;
 
-    for (auto [code, n_entries] : sorted) {
-      os << n_entries << " x ";
-      code.print(*pSrc, os);
-      os << '\n';
+  std::shared_ptr<Resident> resident(const std::string &path) {
+    std::lock_guard lock(mutex);
+    std::shared_ptr<Resident> res = residents[path];
+    if (!res) res = residents[path] = std::make_shared<Resident>();
+    res->last_used = ++clock;
+    // Requests still holding an evicted file finish on it
+    while (residents.size() > MAX_RESIDENT) {
+      auto oldest = residents.begin();
+      for (auto it = residents.begin(); it != residents.end(); ++it)
+        if (it->second->last_used < oldest->second->last_used) oldest = it;
+      residents.erase(oldest);
     }
+    return res;
   }
 
-private:
-  const BytecodeFile                     *pSrc;
-  std::unordered_map<Instruction, size_t> freq;
+  void answer(int client) {
+    std::string request;
+    char        buf[4096];
+    while (request.find('\n') == std::string::npos && request.size() < MAX_REQUEST) {
+      ssize_t n = recv(client, buf, sizeof(buf), 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      request.append(buf, size_t(n));
+    }
+
+    std::string reply;
+    try {
+      size_t end = request.find('\n');
+      if (end == std::string::npos) throw std::runtime_error("Incomplete request");
+      std::string body = report(std::string_view(request).substr(0, end));
+      reply            = "ok\n" + body;
+    } catch (const std::exception &e) {
+      reply = std::string("error ") + e.what() + '\n';
+    }
+    for (size_t sent = 0; sent < reply.size();) {
+      ssize_t n = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return;
+      sent += size_t(n);
+    }
+  }
+
+  std::string report(std::string_view line) {
+    std::vector<std::string> fields;
+    for (size_t start = 0;;) {
+      size_t tab = line.find('\t', start);
+      fields.emplace_back(line.substr(start, tab == std::string_view::npos ? std::string_view::npos : tab - start));
+      if (tab == std::string_view::npos) break;
+      start = tab + 1;
+    }
+    std::vector<const char *> argv{"serve"};
+    for (size_t i = 1; i < fields.size(); ++i) argv.push_back(fields[i].c_str());
+
+    Options opts;
+    if (!opts.parse(int(argv.size()), argv.data()) || opts.paths.size() != 1 || opts.paths[0] == "-")
+      throw std::runtime_error("Invalid request");
+    if (opts.dynamic || opts.write_index || opts.cache_dir || opts.output || opts.stats || opts.serve || opts.client)
+      throw std::runtime_error("Not available from the server");
+    std::filesystem::path path = opts.paths[0];
+    if (path.is_relative()) path = std::filesystem::path(fields[0]) / path;
+
+    std::shared_ptr<Resident> file = resident(path.lexically_normal().string());
+    std::lock_guard           lock(file->mutex);
+    file->refresh(path.string());
+    ProgramIndex &index = file->index;
+
+    std::ostringstream out;
+    if (opts.reachable || opts.loop_base != 0) {
+      estimate_counts(index, opts).print(out, opts.report);
+    } else if (opts.functions) {
+      report_functions(index.prog, index.functions(), opts.jobs, opts.report, out);
+    } else if (opts.ngram != 0) {
+      auto [it, fresh] = file->ngrams.try_emplace({opts.ngram, opts.abstract, opts.approx});
+      if (fresh) it->second.parse(index.prog, index.cfg(), opts.ngram, opts.abstract, opts.approx);
+      it->second.print(out, opts.report);
+    } else if (opts.approx != 0) {
+      HeavyHitters hh(opts.approx);
+      hh.count(index.prog);
+      hh.print(out, opts.report);
+    } else {
+      if (!file->freq) file->freq.emplace().parse(index.prog);
+      file->freq->print(out, opts.report);
+    }
+    return std::move(out).str();
+  }
 };
 
+// Sends one request to a server and writes out its report; false if the server reported an error
+bool ask_server(const char *socket_path, const std::vector<std::string> &args, std::ostream &out) {
+  std::string request = std::filesystem::current_path().string();
+  for (const std::string &arg : args) {
+    if (arg.find_first_of("\t\n") != std::string::npos) throw std::runtime_error("Arguments may not hold tabs");
+    request += '\t';
+    request += arg;
+  }
+  request += '\n';
+
+  sockaddr_un addr = {};
+  addr.sun_family  = AF_UNIX;
+  if (std::strlen(socket_path) >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path is too long");
+  std::strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    throw std::runtime_error(std::string("Cannot connect to ") + socket_path + ": " + std::strerror(errno));
+  for (size_t sent = 0; sent < request.size();) {
+    ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw std::runtime_error(std::string("Cannot send the request: ") + std::strerror(errno));
+    sent += size_t(n);
+  }
+
+  std::string reply;
+  char        buf[1 << 16];
+  for (;;) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    reply.append(buf, size_t(n));
+  }
+  close(fd);
+
+  size_t      end    = reply.find('\n');
+  std::string status = reply.substr(0, end);
+  if (status != "ok") {
+    std::cerr << (status.rfind("error ", 0) == 0 ? status.substr(6) : "No reply from the server") << '\n';
+    return false;
+  }
+  out << std::string_view(reply).substr(end + 1);
+  return true;
+}
+
 int main(int argc, const char *argv[]) {
-  if (argc < 2) {
-    std::cout << "Usage: " << argv[0] << " <bytecode file>\n";
+  Options opts;
+  if (!opts.parse(argc, argv)) {
+    std::cout << "Usage: " << argv[0]
+              << " [--stats] [-j N] [--top N] [--min-count N] [--format text|csv|jsonl|bin]"
+                 " [--level exact,kind,opcode] [--cache DIR] [--prefetch N] [-o FILE]"
+                 " <bytecode file | profile | - | directory | @listfile>...\n"
+              << "       " << argv[0] << " --dynamic [options] <bytecode file>\n"
+              << "       " << argv[0]
+              << " --approx M [options] <bytecode file | profile | - | directory | @listfile>...\n"
+              << "       " << argv[0] << " --ngram N [--abstract] [--approx M] [options] <bytecode file | ->\n"
+              << "       " << argv[0] << " --functions [options] <bytecode file | ->\n"
+              << "       " << argv[0] << " [--reachable] [--loop-weight BASE] [options] <bytecode file | ->\n"
+              << "       " << argv[0] << " --diff [options] <bytecode file | profile> <bytecode file | profile>\n"
+              << "       " << argv[0] << " --write-index <bytecode file>...\n"
+              << "       " << argv[0] << " --serve SOCKET\n"
+              << "       " << argv[0] << " --client SOCKET [options] <bytecode file>\n";
     return EXIT_FAILURE;
   }
 
+  if (opts.serve) {
+    Server server;
+    server.run(opts.serve);
+  }
+  if (opts.client) return ask_server(opts.client, opts.forward, std::cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  std::ofstream fout;
+  if (opts.output) {
+    fout.open(opts.output, std::ios::binary);
+    if (!fout) throw std::runtime_error(std::string("Cannot open ") + opts.output);
+  }
+  std::ostream &out = opts.output ? fout : std::cout;
+
+  if (opts.diff) {
+    FrequencyDiff diff;
+    diff.count(opts.paths[0], opts.paths[1], opts.jobs);
+    diff.print(out, opts.report);
+    if (opts.stats) {
+      diff.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (opts.reachable || opts.loop_base != 0) {
+    BytecodeFile src;
+    load_input(src, opts.paths[0]);
+    ProgramIndex index;
+    load_index(index, src, opts.paths[0]);
+    Frequencies freq = estimate_counts(index, opts);
+    freq.print(out, opts.report);
+    if (opts.stats) {
+      freq.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  if (opts.functions) {
+    BytecodeFile src;
+    load_input(src, opts.paths[0]);
+    ProgramIndex index;
+    load_index(index, src, opts.paths[0]);
+    report_functions(index.prog, index.functions(), opts.jobs, opts.report, out);
+    return EXIT_SUCCESS;
+  }
+
+  if (opts.ngram != 0) {
+    BytecodeFile src;
+    load_input(src, opts.paths[0]);
+    ProgramIndex index;
+    load_index(index, src, opts.paths[0]);
+    NgramFrequencies freq;
+    freq.parse(index.prog, index.cfg(), opts.ngram, opts.abstract, opts.approx);
+    freq.print(out, opts.report);
+    if (opts.stats) {
+      freq.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Counts executed instructions instead of the ones in the file;
+  // the program reads and writes through stdin and stdout, so the report goes after its output
+  if (opts.dynamic) {
+    BytecodeFile src;
+    src.load_file(opts.paths[0].c_str());
+    ProgramIndex index;
+    load_index(index, src, opts.paths[0]);
+    Interpreter vm(index.prog);
+    vm.run();
+    std::fflush(stdout);
+    Frequencies freq;
+    freq.parse(index.prog, vm.counts());
+    freq.print(out, opts.report);
+    if (opts.stats) {
+      freq.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Sidecars for later runs of any of the modes above
+  if (opts.write_index) {
+    for (const std::string &path : opts.paths) {
+      BytecodeFile src;
+      src.load_file(path.c_str());
+      ProgramIndex index;
+      index.decode(src);
+      index.write(src, path + ".bcidx");
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // Memory bounded by the counters rather than by the distinct instructions
+  if (opts.approx != 0) {
+    std::vector<std::string> inputs;
+    for (const std::string &arg : opts.paths) collect_inputs(arg, inputs);
+    BatchStats   batch;
+    HeavyHitters hh = count_approx(inputs, opts.jobs, opts.approx, batch);
+    hh.print(out, opts.report);
+    if (opts.stats) {
+      std::cerr << "files: " << inputs.size() << ", failed: " << batch.failed << '\n';
+      hh.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return batch.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (opts.batch()) {
+    std::vector<std::string> inputs;
+    for (const std::string &arg : opts.paths) collect_inputs(arg, inputs);
+    if (opts.cache_dir) std::filesystem::create_directories(opts.cache_dir);
+    BatchStats  batch;
+    Frequencies freq = count_batch(inputs, opts.jobs, opts.jobs * opts.prefetch, opts.cache_dir, batch);
+    freq.print(out, opts.report);
+    if (opts.stats) {
+      std::cerr << "files: " << inputs.size() << ", failed: " << batch.failed << ", from cache: " << batch.cache_hits
+                << '\n';
+      if (batch.prefetch)
+        std::cerr << "prefetch: " << batch.prefetch << ", " << batch.read_bytes << " bytes, workers waited "
+                  << batch.input_wait << " s\n";
+      freq.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return batch.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Pipes are counted as they arrive instead of being buffered whole
+  const std::string &path = opts.paths[0];
+  if (path == "-" || !std::filesystem::is_regular_file(path)) {
+    std::ifstream  fin;
+    std::istream  *is = &std::cin;
+    if (path != "-") {
+      fin.open(path, std::ios::binary);
+      if (!fin) throw std::runtime_error("Cannot open " + path);
+      is = &fin;
+    }
+    BytecodeStream stream;
+    stream.open(*is);
+    Frequencies freq;
+    freq.parse(stream);
+    freq.print(out, opts.report);
+    if (opts.stats) {
+      freq.print_stats(std::cerr);
+      Instrumentation::print(std::cerr);
+    }
+    return EXIT_SUCCESS;
+  }
+
   BytecodeFile src;
-  {
-    std::ifstream fin(argv[1], std::ios::binary);
-    src.load(fin);
+  src.load_file(path.c_str());
+  Frequencies  freq;
+  ProgramIndex index;
+  if (index.map(src, path + ".bcidx")) {
+    freq.parse(index.prog);
+  } else if (opts.jobs > 1) {
+    freq = count_parallel(src, opts.jobs);
+  } else {
+    index.decode(src);
+    freq.parse(index.prog);
+  }
+  freq.print(out, opts.report);
+  if (opts.stats) {
+    freq.print_stats(std::cerr);
+    Instrumentation::print(std::cerr);
   }
-  Frequencies freq;
-  freq.parse(src);
-  freq.print(std::cout);
 
   return EXIT_SUCCESS;
 }